@@ -7,10 +7,21 @@
 #include <termios.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 
 //*** data ***//
 
@@ -33,19 +44,259 @@ enum editorHighlight {
   HL_NUMBER
 };
 
-// Row object for file content
+// Block of cold rows compressed together, see compressRows()
+struct cblock {
+    char *data;
+    int len; // Compressed size
+    int raw; // Uncompressed size
+    int refs; // Rows still stored in this block
+    size_t scratch; // Offset of the unpacked text in a rowViews() scratch, SIZE_MAX outside of one
+};
+
+// Text of a row read in bulk, see rowViews(). Compressed rows stay compressed
+struct rowView {
+    const char *chars;
+    int size;
+};
+
+// Row object for file content, kept at 24 bytes since large files have millions of them
 typedef struct erow {
     int size;
-    char *chars;
-    char *hl;
+    // Bytes reserved for chars, see rowAlloc(). 0 if chars is borrowed from a mapped
+    // file or the binary, below 0 while the row is compressed, see rowBlock()
+    int cap;
+    char *chars; // The row's block while compressed
+    unsigned int stamp; // Edit count at the last change, 0 if never edited
 } erow;
 
-// Buffer to hold volatile data
+// Buffer to hold volatile data, grows by doubling and is reused after bufReset()
 struct buf {
     char *b;
     int len;
+    int cap;
+};
+#define BUF_INIT {NULL, 0, 0}
+
+// Unpacked blocks for rowViews(), which may hold more than a struct buf can
+struct scratch {
+    char *b;
+    size_t len;
+    size_t cap;
+};
+#define SCRATCH_INIT {NULL, 0, 0}
+
+// Row text is carved out of large chunks in power of two size classes
+#define SLAB_MIN_SHIFT 4 // Smallest class holds 16 bytes
+#define SLAB_CLASSES 9 // Largest class holds 4096 bytes, longer rows use malloc
+#define SLAB_CHUNK (256 * 1024)
+
+struct slabFree {
+    struct slabFree *next;
+};
+
+struct slab {
+    struct slabFree *free[SLAB_CLASSES];
+    char *chunk;
+    size_t chunkLeft;
+    char **chunks; // Every chunk, so they can be given back, see slabRelease()
+    int numchunks;
+    int chunkCap;
+    long live; // Slab allocations not freed yet
+};
+struct slab slab;
+
+// Rows far from the viewport that have not been edited lately are compressed
+#define COLD_BLOCK_ROWS 256
+#define COLD_MIN_BYTES 4096 // Smaller blocks are not worth compressing
+#define COLD_MARGIN 1024 // Rows kept uncompressed above and below the viewport
+#define COLD_AGE 256 // Edits before a changed row counts as cold again
+
+struct coldStore {
+    struct buf raw; // Scratch for compressRows()
+    struct buf packed;
+    struct buf cache; // Last decompressed block
+    struct cblock *cached;
+};
+struct coldStore C;
+
+// Allocation counters, shown by the stats command
+struct memStats {
+    long chunks;
+    long slabAllocs;
+    long slabFrees;
+    long largeAllocs;
+    long bufGrows;
+    long frames;
+    long coldBlocks;
+    long coldRows;
+    long coldRaw;
+    long coldBytes;
+};
+struct memStats M;
+
+// Frequency counted trie of the words in the buffer, used for completion
+#define WORD_MIN 2
+#define WORD_MAX 64
+#define COMPLETE_MAX 8 // Candidates offered per completion
+#define COMPLETE_VISIT 4096 // Trie nodes looked at per lookup at most
+
+struct tnode {
+    int child; // First child, 0 if none since node 0 is the root
+    int next; // Next sibling
+    int count; // Occurrences of the word ending here
+    int total; // Occurrences of all words in this subtree
+    char c;
+};
+
+struct completion {
+    int row, at; // Where the inserted text starts
+    int prefix; // Length of the typed part of the word
+    int inserted;
+    int current, count;
+    char word[COMPLETE_MAX][WORD_MAX + 1];
+    int freq[COMPLETE_MAX];
+};
+
+struct wordIndex {
+    struct tnode *node;
+    int numnodes;
+    int cap;
+    int built; // The index is only kept up to date once the first completion built it
+    struct completion complete;
+};
+struct wordIndex W;
+
+// Trie nodes reached by a lookup, expanded best first by subtree total
+struct wordVisit {
+    int node;
+    int parent; // Visit the node was reached from, -1 for the end of the prefix
+    int depth;
+};
+
+struct wordSearch {
+    struct wordVisit *visit;
+    int count;
+    int cap;
+    int *heap; // Visits not expanded yet, largest subtree total on top
+    int numheap;
+};
+
+// Row sorting splits the rows over threads, then merges the runs pairwise
+#define SORT_MAX_THREADS 16
+#define SORT_MIN_ROWS 65536 // Rows per thread below which more threads do not pay off
+
+struct sortJob {
+    struct rowView **a;
+    struct rowView **tmp;
+    int lo, mid, hi; // mid is -1 to sort [lo, hi), otherwise merge the two runs
+};
+
+// Binary files are shown as offset, hex and text columns straight from a mapping
+#define HEX_WIDTH 16 // Bytes per line
+
+// A changed byte, kept until it is written back
+struct hexPatch {
+    size_t off;
+    unsigned char byte;
+};
+
+struct hexView {
+    int active;
+    int fd;
+    unsigned char *map;
+    size_t size;
+    int digits; // Width of the offset column, at least 8 and more for files of 4 GiB and up
+    struct hexPatch *patch; // Sorted by offset
+    int numpatches;
+    int cap;
+    size_t top; // First line on screen
+    size_t cursor; // Offset of the byte under the cursor
+    int nibble; // The low nibble of the byte is typed next
+    int text; // Typing goes to the text column instead of the hex digits
+};
+struct hexView H;
+
+// Extra cursors, or a column block between an anchor and the cursor.
+// Every keystroke is applied to all of them in a single pass over the rows.
+struct mcursor {
+    int row, col; // Both from 0
+};
+
+struct multiCursor {
+    struct mcursor *cur; // Sorted by row, then column
+    int count;
+    int cap;
+    int block;
+    int blockRow, blockCol; // Anchor of the column block
+};
+struct multiCursor MC;
+
+// One place a batched edit changes: del characters go at col, then the typed one is inserted
+struct editTarget {
+    int row, col;
+    int del;
+    int who; // Cursor to move along, an index into MC.cur, -1 for the main cursor, -2 for none
+};
+
+// Line of text the editor does not own, rows point at it instead of copying it
+struct staticRow {
+    const char *chars;
+    int size;
+};
+
+// help.txt, embedded at build time by the Makefile
+#define HELP_ROW(s) {s, sizeof(s) - 1}
+const struct staticRow helpRows[] = {
+#include "help.h"
+};
+
+// Sidecar line index for large files, kept in the user's cache directory
+#define CACHE_MAGIC "JAKKIDX1"
+#define CACHE_MIN_SIZE (1 << 20) // Smaller files load fast enough without it
+
+struct cacheHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtimeNsec;
+    uint64_t ino;
+    uint64_t dev;
+    int64_t numrows;
+    int32_t cx, cy;
+    int32_t offsetY;
+    int32_t pathLen;
+};
+// Followed by the path, padding to 8 bytes, uint64_t offsets[numrows] and uint32_t lengths[numrows]
+
+struct lineIndex {
+    uint64_t *off;
+    uint32_t *len;
+    int count;
+    int cap;
+};
+
+// Sent by an attaching client, then the connection carries raw terminal I/O
+struct attachRequest {
+    int32_t rows, cols;
+    char cwd[PATH_MAX];
+    char file[PATH_MAX];
+};
+
+// A file kept loaded by the server, sessions get a copy on write view of it
+#define SERVER_MAX_BUFS 16
+#define SERVER_HANDSHAKE_SEC 2 // Clients that do not send their request in time are dropped
+
+struct sharedBuf {
+    char *path;
+    struct stat st;
+    erow *row;
+    int numrows, rowcap;
+    char *map;
+    size_t mapSize;
+    char *cacheFile;
+    int cx, cy, offsetY;
+    int readOnly;
 };
-#define BUF_INIT {NULL, 0}
 
 struct editorConfig {
     struct termios termDefault;
@@ -56,28 +307,41 @@ struct editorConfig {
 
     // File content
     int numrows;
+    int rowcap;
     erow *row;
     int rowHl;
     int offsetY;
     int startX;
+    unsigned int edits;
+    int coldY; // offsetY at the last compressColdRows() pass, -1 if none
 
     // File and editing attributes
     char *filename;
+    char *map; // Mapping of the file when opened through the index cache
+    size_t mapSize;
+    char *cacheFile; // Index cache that matches the file on disk
     int insert;
     int readOnly;
+    int remote; // Terminal I/O goes through an attached client
 
     // Command input and prompt
     struct buf cmd;
     struct buf cmdSave;
     struct buf prompt;
+
+    // Render output, reset every frame
+    struct buf frame;
 };
 struct editorConfig E;
 
+// Cursor position in the file while in command mode
+int saveX, saveY;
+
 //*** terminal ***//
 
 int getWindowSize(int *rows, int *cols) {
     struct winsize ws;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return -1;
     *cols = ws.ws_col;
     *rows = ws.ws_row;
     return 0;
@@ -111,36 +375,1093 @@ void enableRawMode() {
 
 //*** buffer ***//
 
-void bufAppend(struct buf *ab, const char *s, int len) {
+// Make room for len more bytes plus a terminating null
+int bufGrow(struct buf *ab, int len) {
+    if (ab->len + len + 1 <= ab->cap) return 0;
 
-    char *new = realloc(ab->b, ab->len + len);
+    int cap = ab->cap ? ab->cap : 64;
+    while (cap < ab->len + len + 1) cap *= 2;
 
-    if (new == NULL) return;
+    char *new = realloc(ab->b, cap);
 
-    memcpy(&new[ab->len], s, len);
+    if (new == NULL) return -1;
 
     ab->b = new;
+    ab->cap = cap;
+    M.bufGrows++;
+    return 0;
+}
+
+void bufAppend(struct buf *ab, const char *s, int len) {
+    if (bufGrow(ab, len) == -1) return;
+
+    memcpy(&ab->b[ab->len], s, len);
+
     ab->len += len;
+    ab->b[ab->len] = '\0';
 }
 
 void bufAppendChar(struct buf *ab, const char c) {
+    bufAppend(ab, &c, 1);
+}
+
+// Empty the buffer but keep its memory for the next use
+void bufReset(struct buf *ab) {
+    ab->len = 0;
+    if (ab->b) ab->b[0] = '\0';
+}
+
+void bufFree(struct buf *ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+//*** row storage ***//
+
+int slabClass(size_t size) {
+    int c = 0;
+    while (c < SLAB_CLASSES && ((size_t) 1 << (c + SLAB_MIN_SHIFT)) < size) c++;
+    return c;
+}
+
+// Allocate at least size bytes for row text, the usable size is stored in cap
+char *rowAlloc(size_t size, int *cap) {
+    int c = slabClass(size);
+
+    if (c == SLAB_CLASSES) {
+        M.largeAllocs++;
+        *cap = size;
+        return malloc(size);
+    }
+
+    size_t classSize = (size_t) 1 << (c + SLAB_MIN_SHIFT);
+    *cap = classSize;
+    M.slabAllocs++;
 
-    char s[1];
-    strcpy(s , (char[1]) { (char) c } );
+    if (slab.free[c]) {
+        struct slabFree *p = slab.free[c];
+        slab.free[c] = p->next;
+        slab.live++;
+        return (char *) p;
+    }
+
+    if (slab.chunkLeft < classSize) {
+        if (slab.numchunks == slab.chunkCap) {
+            int cap = slab.chunkCap ? slab.chunkCap * 2 : 64;
+            char **new = realloc(slab.chunks, sizeof(char *) * cap);
+            if (new == NULL) return NULL;
+            slab.chunks = new;
+            slab.chunkCap = cap;
+        }
+        slab.chunk = malloc(SLAB_CHUNK);
+        if (slab.chunk == NULL) {
+            slab.chunkLeft = 0;
+            return NULL;
+        }
+        slab.chunks[slab.numchunks++] = slab.chunk;
+        slab.chunkLeft = SLAB_CHUNK;
+        M.chunks++;
+    }
+
+    slab.live++;
+    char *p = slab.chunk;
+    slab.chunk += classSize;
+    slab.chunkLeft -= classSize;
+    return p;
+}
 
-    char *new = realloc(ab->b, ab->len + 1);
+void rowFree(char *p, int cap) {
+    if (p == NULL || cap <= 0) return;
 
+    int c = slabClass(cap);
+    if (c == SLAB_CLASSES) {
+        free(p);
+        return;
+    }
+
+    struct slabFree *f = (struct slabFree *) p;
+    f->next = slab.free[c];
+    slab.free[c] = f;
+    slab.live--;
+    M.slabFrees++;
+}
+
+// Give every chunk back once no row uses the slabs any more, e.g. after closing a file
+void slabRelease() {
+    if (slab.live > 0) return;
+
+    for (int i = 0; i < slab.numchunks; i++) free(slab.chunks[i]);
+    free(slab.chunks);
+    M.chunks -= slab.numchunks;
+    memset(&slab, 0, sizeof(slab));
+}
+
+// Make sure the row can hold size bytes, growing at least twofold
+void rowReserve(erow *row, int size) {
+    if (size <= row->cap || row->cap < 0) return; // Compressed rows are inflated first
+
+    int cap;
+    char *new = rowAlloc(size < row->cap * 2 ? row->cap * 2 : size, &cap);
     if (new == NULL) return;
 
-    memcpy(&new[ab->len], s, 1);
+    memcpy(new, row->chars, row->size);
+    new[row->size] = '\0';
+    rowFree(row->chars, row->cap);
 
-    ab->b = new;
-    ab->len++;;
+    row->chars = new;
+    row->cap = cap;
 }
 
-void bufFree(struct buf *ab) {
-    ab->b = NULL;
-    ab->len = 0;
+//*** compression ***//
+
+// Byte oriented LZ77 in the style of LZ4. Every sequence starts with a token
+// holding the literal count (high nibble) and match length - 4 (low nibble),
+// a nibble of 15 continues in extra bytes. Literals follow, then a two byte
+// little endian match offset. The last sequence has literals only.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+int lzBound(int len) {
+    return len + len / 255 + 16;
+}
+
+unsigned int lzHash(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+int lzPutLength(unsigned char *dst, int op, int n) {
+    for (n -= 15; n >= 255; n -= 255) dst[op++] = 255;
+    dst[op++] = n;
+    return op;
+}
+
+int lzPutSequence(unsigned char *dst, int op, const unsigned char *lit, int litlen, int offset, int mlen) {
+    int m = mlen ? mlen - LZ_MIN_MATCH : 0;
+    dst[op++] = ((litlen < 15 ? litlen : 15) << 4) | (m < 15 ? m : 15);
+    if (litlen >= 15) op = lzPutLength(dst, op, litlen);
+    memcpy(&dst[op], lit, litlen);
+    op += litlen;
+    if (mlen == 0) return op;
+
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    if (m >= 15) op = lzPutLength(dst, op, m);
+    return op;
+}
+
+// dst must hold lzBound(len) bytes, returns the compressed size
+int lzCompress(const char *src, int len, char *dst) {
+    const unsigned char *s = (const unsigned char *) src;
+    unsigned char *d = (unsigned char *) dst;
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+    while (ip + LZ_MIN_MATCH <= len) {
+        unsigned int h = lzHash(&s[ip]);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(&s[ref], &s[ip], LZ_MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len && s[ref + mlen] == s[ip + mlen]) mlen++;
+
+        op = lzPutSequence(d, op, &s[anchor], ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    return lzPutSequence(d, op, &s[anchor], len - anchor, 0, 0);
+}
+
+int lzGetLength(const unsigned char *s, int *ip, int len, int n) {
+    if (n < 15) return n;
+    while (*ip < len) {
+        unsigned char b = s[(*ip)++];
+        n += b;
+        if (b != 255) break;
+    }
+    return n;
+}
+
+// Returns the decompressed size, or -1 if the input is malformed
+int lzDecompress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *s = (const unsigned char *) src;
+    int ip = 0, op = 0;
+
+    while (ip < len) {
+        unsigned char token = s[ip++];
+
+        int litlen = lzGetLength(s, &ip, len, token >> 4);
+        if (ip + litlen > len || op + litlen > cap) return -1;
+        memcpy(&dst[op], &s[ip], litlen);
+        ip += litlen;
+        op += litlen;
+        if (ip == len) break;
+
+        if (ip + 2 > len) return -1;
+        int offset = s[ip] | (s[ip + 1] << 8);
+        ip += 2;
+        int mlen = lzGetLength(s, &ip, len, token & 0x0f) + LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + mlen > cap) return -1;
+
+        // Byte by byte since the match may overlap its own output
+        for (int i = 0; i < mlen; i++, op++) dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+//*** cold rows ***//
+
+// Block holding a compressed row, NULL if the row is not compressed
+struct cblock *rowBlock(const erow *row) {
+    return row->cap < 0 ? (struct cblock *) row->chars : NULL;
+}
+
+// Offset of a compressed row's text in its uncompressed block
+int rowBlockOffset(const erow *row) {
+    return -1 - row->cap;
+}
+
+void rowSetBlock(erow *row, struct cblock *cb, int off) {
+    row->chars = (char *) cb;
+    row->cap = -1 - off;
+}
+
+int rowIsCold(erow *row) {
+    return row->cap > 0 && (row->stamp == 0 || E.edits - row->stamp > COLD_AGE);
+}
+
+void rowTouch(erow *row) {
+    row->stamp = ++E.edits;
+}
+
+// Compress the text in C.raw into a block for n rows, NULL if it is not worth it
+struct cblock *coldPack(int n) {
+    if (C.raw.len < COLD_MIN_BYTES) return NULL;
+
+    bufReset(&C.packed);
+    if (bufGrow(&C.packed, lzBound(C.raw.len)) == -1) return NULL;
+    int len = lzCompress(C.raw.b, C.raw.len, C.packed.b);
+    if (len > C.raw.len - C.raw.len / 8) return NULL;
+
+    struct cblock *cb = malloc(sizeof(struct cblock));
+    if (cb == NULL) return NULL;
+    cb->data = malloc(len);
+    if (cb->data == NULL) {
+        free(cb);
+        return NULL;
+    }
+    memcpy(cb->data, C.packed.b, len);
+    cb->len = len;
+    cb->raw = C.raw.len;
+    cb->refs = n;
+    cb->scratch = SIZE_MAX;
+
+    M.coldBlocks++;
+    M.coldRows += n;
+    M.coldRaw += cb->raw;
+    M.coldBytes += cb->len;
+    return cb;
+}
+
+// Compress the cold rows in [start, end) into one block
+void compressRows(int start, int end) {
+    int n = 0, want = 0;
+    bufReset(&C.raw);
+    for (int i = start; i < end; i++) {
+        if (!rowIsCold(&E.row[i])) continue;
+        bufAppend(&C.raw, E.row[i].chars, E.row[i].size);
+        want += E.row[i].size;
+        n++;
+    }
+    if (C.raw.len != want) return;
+
+    struct cblock *cb = coldPack(n);
+    if (cb == NULL) return;
+
+    int off = 0;
+    for (int i = start; i < end; i++) {
+        erow *row = &E.row[i];
+        if (!rowIsCold(row)) continue;
+        rowFree(row->chars, row->cap);
+        rowSetBlock(row, cb, off);
+        off += row->size;
+    }
+}
+
+// Compress blocks away from the viewport, once it has moved far enough
+void compressColdRows() {
+    if (E.coldY >= 0 && abs(E.offsetY - E.coldY) < COLD_MARGIN / 2) return;
+
+    int lo = E.offsetY - COLD_MARGIN;
+    int hi = E.offsetY + E.screenrows + COLD_MARGIN;
+    for (int start = 0; start < E.numrows; start += COLD_BLOCK_ROWS) {
+        int end = start + COLD_BLOCK_ROWS < E.numrows ? start + COLD_BLOCK_ROWS : E.numrows;
+        if (end > lo && start < hi) continue;
+        compressRows(start, end);
+    }
+    E.coldY = E.offsetY;
+}
+
+// Drop the row's reference to its block, freeing the block with the last one
+void coldRelease(erow *row) {
+    struct cblock *cb = rowBlock(row);
+    if (cb == NULL) return;
+
+    row->chars = NULL;
+    row->cap = 0;
+    M.coldRows--;
+    if (--cb->refs > 0) return;
+
+    if (C.cached == cb) C.cached = NULL;
+    M.coldBlocks--;
+    M.coldRaw -= cb->raw;
+    M.coldBytes -= cb->len;
+    free(cb->data);
+    free(cb);
+}
+
+// Row text without inflating the row, valid until another block is read
+const char *rowPeek(erow *row) {
+    struct cblock *cb = rowBlock(row);
+    if (cb == NULL) return row->chars;
+
+    if (C.cached != cb) {
+        C.cached = NULL;
+        bufReset(&C.cache);
+        if (bufGrow(&C.cache, cb->raw) == -1) return NULL;
+        if (lzDecompress(cb->data, cb->len, C.cache.b, cb->raw) != cb->raw) return NULL;
+        C.cached = cb;
+    }
+    return &C.cache.b[rowBlockOffset(row)];
+}
+
+// Point v at the text of rows [from, to). Each compressed block in the range is
+// unpacked once into scratch, which must outlive the views. Unlike rowPeek() this
+// stays fast when neighbouring rows come from different blocks, but it holds the
+// whole range unpacked, so only sorting uses it
+int rowViews(int from, int to, struct rowView *v, struct scratch *scratch) {
+    int ret = 0;
+    for (int i = from; i < to && ret == 0; i++) {
+        struct cblock *cb = rowBlock(&E.row[i]);
+        if (cb == NULL || cb->scratch != SIZE_MAX) continue;
+        if (scratch->len + cb->raw > scratch->cap) {
+            size_t cap = scratch->cap ? scratch->cap : 65536;
+            while (cap < scratch->len + cb->raw) cap *= 2;
+            char *b = realloc(scratch->b, cap);
+            if (b == NULL) {
+                ret = -1;
+                break;
+            }
+            scratch->b = b;
+            scratch->cap = cap;
+        }
+        if (lzDecompress(cb->data, cb->len, &scratch->b[scratch->len], cb->raw) != cb->raw) ret = -1;
+        else {
+            cb->scratch = scratch->len;
+            scratch->len += cb->raw;
+        }
+    }
+
+    for (int i = from; i < to && ret == 0; i++) {
+        erow *row = &E.row[i];
+        v[i - from].size = row->size;
+        struct cblock *cb = rowBlock(row);
+        v[i - from].chars = cb ? &scratch->b[cb->scratch + rowBlockOffset(row)] : row->chars;
+    }
+    for (int i = from; i < to; i++)
+        if (rowBlock(&E.row[i])) rowBlock(&E.row[i])->scratch = SIZE_MAX;
+    return ret;
+}
+
+// Move the compressed rows in [start, end) into fresh blocks in row order, so reading
+// them in order is cheap again after a sort. text[i - start] is row i's current text
+void repackRows(int start, int end, const struct rowView *text) {
+    for (int s = start; s < end; s += COLD_BLOCK_ROWS) {
+        int e = s + COLD_BLOCK_ROWS < end ? s + COLD_BLOCK_ROWS : end;
+        int n = 0, want = 0;
+        bufReset(&C.raw);
+        for (int i = s; i < e; i++) {
+            if (rowBlock(&E.row[i]) == NULL) continue;
+            bufAppend(&C.raw, text[i - start].chars, text[i - start].size);
+            want += text[i - start].size;
+            n++;
+        }
+        if (n == 0) continue;
+        struct cblock *cb = C.raw.len == want ? coldPack(n) : NULL;
+
+        // Rows that do not fit a new block get their own copy instead
+        int off = 0;
+        for (int i = s; i < e; i++) {
+            erow *row = &E.row[i];
+            if (rowBlock(row) == NULL) continue;
+            if (cb) {
+                coldRelease(row);
+                rowSetBlock(row, cb, off);
+                off += row->size;
+                continue;
+            }
+            int cap;
+            char *chars = rowAlloc(row->size + 1, &cap);
+            if (chars == NULL) continue;
+            memcpy(chars, text[i - start].chars, row->size);
+            chars[row->size] = '\0';
+            coldRelease(row);
+            row->chars = chars;
+            row->cap = cap;
+        }
+    }
+}
+
+// Give a compressed row its own text again
+void rowInflate(erow *row) {
+    if (rowBlock(row) == NULL) return;
+
+    const char *text = rowPeek(row);
+    if (text == NULL) return;
+
+    int cap;
+    char *chars = rowAlloc(row->size + 1, &cap);
+    if (chars == NULL) return;
+    memcpy(chars, text, row->size);
+    chars[row->size] = '\0';
+
+    coldRelease(row);
+    row->chars = chars;
+    row->cap = cap;
+}
+
+// Make the row text writable, copying it out of a block or mapped file
+void rowOwn(erow *row) {
+    rowInflate(row);
+    rowReserve(row, row->size + 1);
+}
+
+//*** word index ***//
+
+double elapsedMs(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int isWordChar(char c) {
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+// Widen [*l, *r) to whole words, the only text an edit inside it can change
+void wordSpan(const char *s, int size, int *l, int *r) {
+    while (*l > 0 && isWordChar(s[*l - 1])) (*l)--;
+    while (*r < size && isWordChar(s[*r])) (*r)++;
+}
+
+int trieChild(int n, char c, int create) {
+    int i;
+    for (i = W.node[n].child; i; i = W.node[i].next)
+        if (W.node[i].c == c) return i;
+    if (!create) return 0;
+
+    if (W.numnodes == W.cap) {
+        int cap = W.cap * 2;
+        struct tnode *new = realloc(W.node, sizeof(struct tnode) * cap);
+        if (new == NULL) return 0;
+        W.node = new;
+        W.cap = cap;
+    }
+    i = W.numnodes++;
+    W.node[i].child = 0;
+    W.node[i].next = W.node[n].child;
+    W.node[i].count = 0;
+    W.node[i].total = 0;
+    W.node[i].c = c;
+    W.node[n].child = i;
+    return i;
+}
+
+void indexWord(const char *w, int len, int delta) {
+    int n = 0;
+    if (delta < 0) {
+        for (int i = 0; i < len && (n = trieChild(n, w[i], 0)); i++) {}
+        if (n == 0 || W.node[n].count + delta < 0) return;
+        n = 0;
+    }
+
+    W.node[0].total += delta;
+    for (int i = 0; i < len; i++) {
+        n = trieChild(n, w[i], 1);
+        if (n == 0) return;
+        W.node[n].total += delta;
+    }
+    W.node[n].count += delta;
+}
+
+// Add (delta 1) or remove (delta -1) every word in s
+void indexWords(const char *s, int len, int delta) {
+    if (!W.built || s == NULL) return;
+
+    for (int i = 0; i < len; ) {
+        if (!isWordChar(s[i])) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < len && isWordChar(s[i])) i++;
+        if (i - start >= WORD_MIN && i - start <= WORD_MAX) indexWord(&s[start], i - start, delta);
+    }
+}
+
+void wordIndexReset() {
+    free(W.node);
+    W.node = NULL;
+    W.numnodes = 0;
+    W.cap = 0;
+    W.built = 0;
+    W.complete.count = 0;
+}
+
+void buildWordIndex() {
+    W.cap = 1024;
+    W.node = malloc(sizeof(struct tnode) * W.cap);
+    if (W.node == NULL) return;
+    memset(&W.node[0], 0, sizeof(struct tnode));
+    W.numnodes = 1;
+    W.built = 1;
+
+    for (int i = 0; i < E.numrows; i++) {
+        const char *text = rowPeek(&E.row[i]);
+        if (text == NULL) {
+            wordIndexReset(); // Better no index than one missing words
+            return;
+        }
+        indexWords(text, E.row[i].size, 1);
+    }
+}
+
+int visitTotal(struct wordSearch *s, int v) {
+    return W.node[s->visit[v].node].total;
+}
+
+int searchPush(struct wordSearch *s, int node, int parent, int depth) {
+    if (s->count == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 256;
+        struct wordVisit *visit = realloc(s->visit, sizeof(struct wordVisit) * cap);
+        if (visit == NULL) return -1;
+        s->visit = visit;
+        int *heap = realloc(s->heap, sizeof(int) * cap);
+        if (heap == NULL) return -1;
+        s->heap = heap;
+        s->cap = cap;
+    }
+
+    int v = s->count++;
+    s->visit[v].node = node;
+    s->visit[v].parent = parent;
+    s->visit[v].depth = depth;
+
+    int i = s->numheap++;
+    while (i > 0 && visitTotal(s, s->heap[(i - 1) / 2]) < visitTotal(s, v)) {
+        s->heap[i] = s->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->heap[i] = v;
+    return 0;
+}
+
+int searchPop(struct wordSearch *s) {
+    int top = s->heap[0];
+    int last = s->heap[--s->numheap];
+    int i = 0;
+    while (1) {
+        int c = 2 * i + 1;
+        if (c >= s->numheap) break;
+        if (c + 1 < s->numheap && visitTotal(s, s->heap[c + 1]) > visitTotal(s, s->heap[c])) c++;
+        if (visitTotal(s, s->heap[c]) <= visitTotal(s, last)) break;
+        s->heap[i] = s->heap[c];
+        i = c;
+    }
+    if (s->numheap > 0) s->heap[i] = last;
+    return top;
+}
+
+// Add the word ending at visit v to the candidates if it is frequent enough, word holds the prefix
+void keepWord(struct wordSearch *s, int v, char *word, int c) {
+    struct completion *k = &W.complete;
+    int depth = s->visit[v].depth;
+    if (k->count == COMPLETE_MAX && c <= k->freq[COMPLETE_MAX - 1]) return;
+
+    for (int j = v; s->visit[j].parent >= 0; j = s->visit[j].parent)
+        word[s->visit[j].depth - 1] = W.node[s->visit[j].node].c;
+
+    int i = k->count < COMPLETE_MAX ? k->count++ : COMPLETE_MAX - 1;
+    while (i > 0 && c > k->freq[i - 1]) {
+        k->freq[i] = k->freq[i - 1];
+        memcpy(k->word[i], k->word[i - 1], WORD_MAX + 1);
+        i--;
+    }
+    k->freq[i] = c;
+    memcpy(k->word[i], word, depth);
+    k->word[i][depth] = '\0';
+}
+
+// Fill W.complete with the most frequent words starting with prefix. Subtrees are
+// looked at in order of their total, so the visit limit only ever cuts off rare words
+void lookupWords(const char *prefix, int len) {
+    struct completion *k = &W.complete;
+    struct wordSearch s = {NULL, 0, 0, NULL, 0};
+    char word[WORD_MAX + 1];
+    int n = 0;
+
+    k->count = 0;
+    if (len > WORD_MAX) return;
+    for (int i = 0; i < len; i++)
+        if ((n = trieChild(n, prefix[i], 0)) == 0) return;
+    memcpy(word, prefix, len);
+
+    if (searchPush(&s, n, -1, len) == 0) {
+        for (int visits = 0; s.numheap > 0 && visits < COMPLETE_VISIT; visits++) {
+            int v = searchPop(&s);
+            int node = s.visit[v].node, depth = s.visit[v].depth;
+
+            // Nothing left can beat the weakest candidate kept so far
+            if (k->count == COMPLETE_MAX && W.node[node].total <= k->freq[COMPLETE_MAX - 1]) break;
+
+            if (W.node[node].count > 0 && depth > len) keepWord(&s, v, word, W.node[node].count);
+            if (depth == WORD_MAX) continue;
+            for (int i = W.node[node].child; i; i = W.node[i].next)
+                if (W.node[i].total > 0 && searchPush(&s, i, v, depth + 1) == -1) break;
+        }
+    }
+    free(s.visit);
+    free(s.heap);
+}
+
+//*** hex view ***//
+
+// Treat a file as binary if its first block holds a null byte
+int isBinaryFile(const char *filename) {
+    char buf[4096];
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+int hexFindPatch(size_t off) {
+    int lo = 0, hi = H.numpatches;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (H.patch[mid].off < off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int hexByte(size_t off, int *patched) {
+    int i = hexFindPatch(off);
+    *patched = i < H.numpatches && H.patch[i].off == off;
+    return *patched ? H.patch[i].byte : H.map[off];
+}
+
+void hexSetByte(size_t off, unsigned char byte) {
+    int i = hexFindPatch(off);
+    if (i < H.numpatches && H.patch[i].off == off) {
+        H.patch[i].byte = byte;
+        return;
+    }
+
+    if (H.numpatches == H.cap) {
+        int cap = H.cap ? H.cap * 2 : 64;
+        struct hexPatch *new = realloc(H.patch, sizeof(struct hexPatch) * cap);
+        if (new == NULL) return;
+        H.patch = new;
+        H.cap = cap;
+    }
+    memmove(&H.patch[i + 1], &H.patch[i], sizeof(struct hexPatch) * (H.numpatches - i));
+    H.patch[i].off = off;
+    H.patch[i].byte = byte;
+    H.numpatches++;
+}
+
+int hexRows() {
+    return E.screenrows - 3;
+}
+
+void hexMoveTo(size_t off) {
+    if (off >= H.size) off = H.size ? H.size - 1 : 0;
+    H.cursor = off;
+    H.nibble = 0;
+
+    size_t line = off / HEX_WIDTH;
+    if (line < H.top) H.top = line;
+    else if (line >= H.top + hexRows()) H.top = line - hexRows() + 1;
+}
+
+// Screen column of the cursor
+int hexCursorCol() {
+    int i = H.cursor % HEX_WIDTH;
+    int hex = H.digits + 3; // After the offset and two spaces
+    if (H.text) return hex + HEX_WIDTH * 3 + 2 + i;
+    return hex + i * 3 + (i >= HEX_WIDTH / 2) + H.nibble;
+}
+
+int hexLineVisible(int y) {
+    size_t off = (H.top + y - 1) * HEX_WIDTH;
+    return off < H.size || (off == 0 && H.size == 0);
+}
+
+void drawHexLine(struct buf *ab, int y) {
+    size_t off = (H.top + y - 1) * HEX_WIDTH;
+    int n = H.size - off < HEX_WIDTH ? (int) (H.size - off) : HEX_WIDTH;
+    int bytes[HEX_WIDTH], patched[HEX_WIDTH];
+    char s[24];
+
+    int len = snprintf(s, sizeof(s), "%0*zx  ", H.digits, off);
+    bufAppend(ab, s, len);
+
+    for (int i = 0; i < HEX_WIDTH; i++) {
+        if (i == HEX_WIDTH / 2) bufAppend(ab, " ", 1);
+        if (i >= n) {
+            bufAppend(ab, "   ", 3);
+            continue;
+        }
+        bytes[i] = hexByte(off + i, &patched[i]);
+        snprintf(s, sizeof(s), "%02x ", bytes[i]);
+        if (patched[i]) bufAppend(ab, "\x1b[33m", 5);
+        bufAppend(ab, s, 3);
+        if (patched[i]) bufAppend(ab, "\x1b[m", 3);
+    }
+
+    bufAppend(ab, "|", 1);
+    for (int i = 0; i < n; i++) {
+        char c = isprint(bytes[i]) ? bytes[i] : '.';
+        if (patched[i]) bufAppend(ab, "\x1b[33m", 5);
+        bufAppend(ab, &c, 1);
+        if (patched[i]) bufAppend(ab, "\x1b[m", 3);
+    }
+    bufAppend(ab, "|\r\n", 3);
+}
+
+int openHex(const char *filename) {
+    struct stat st;
+    int fd = open(filename, O_RDWR);
+    E.readOnly = 0;
+    if (fd == -1) {
+        fd = open(filename, O_RDONLY);
+        E.readOnly = 1;
+    }
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    // Shared, so bytes written back with pwrite show up in the mapping
+    H.map = NULL;
+    if (st.st_size > 0) {
+        H.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (H.map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    H.active = 1;
+    H.fd = fd;
+    H.size = st.st_size;
+    H.digits = 8;
+    while (H.digits < 16 && (uint64_t) H.size >> (4 * H.digits)) H.digits++;
+    H.numpatches = 0;
+    H.top = 0;
+    H.cursor = 0;
+    H.nibble = 0;
+    H.text = 0;
+    return 0;
+}
+
+void hexClose() {
+    if (!H.active) return;
+    if (H.map) munmap(H.map, H.size);
+    close(H.fd);
+    free(H.patch);
+    H.patch = NULL;
+    H.numpatches = 0;
+    H.cap = 0;
+    H.map = NULL;
+    H.active = 0;
+}
+
+// Write the patches back in runs of adjacent bytes
+int hexSave() {
+    unsigned char run[4096];
+    int i = 0, ret = 0;
+    while (i < H.numpatches) {
+        int first = i;
+        size_t start = H.patch[i].off;
+        int n = 0;
+        while (i < H.numpatches && H.patch[i].off == start + n && n < (int) sizeof(run))
+            run[n++] = H.patch[i++].byte;
+        ssize_t written = pwrite(H.fd, run, n, start);
+        if (written != n) {
+            i = first + (written > 0 ? written : 0);
+            ret = -1;
+            break;
+        }
+    }
+
+    // Patches that did not make it stay for the next save
+    memmove(H.patch, &H.patch[i], sizeof(struct hexPatch) * (H.numpatches - i));
+    H.numpatches -= i;
+    return ret;
+}
+
+// Overwrite the byte under the cursor, a hex digit at a time or as text
+void hexType(int c) {
+    if (H.size == 0) return;
+
+    if (H.text) {
+        if (c < 32 || c > 126) return;
+        hexSetByte(H.cursor, c);
+        hexMoveTo(H.cursor + 1);
+        return;
+    }
+
+    if (c > 127 || !isxdigit(c)) return;
+    int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+    int patched;
+    int b = hexByte(H.cursor, &patched);
+
+    if (!H.nibble) {
+        hexSetByte(H.cursor, (b & 0x0f) | (v << 4));
+        H.nibble = 1;
+    } else {
+        hexSetByte(H.cursor, (b & 0xf0) | v);
+        hexMoveTo(H.cursor + 1);
+    }
+}
+
+//*** multiple cursors ***//
+
+int multiActive() {
+    return MC.count > 0 || MC.block;
+}
+
+void multiClear() {
+    free(MC.cur);
+    MC.cur = NULL;
+    MC.count = 0;
+    MC.cap = 0;
+    MC.block = 0;
+}
+
+// Index of the first cursor at or after row, col
+int multiFind(int row, int col) {
+    int lo = 0, hi = MC.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (MC.cur[mid].row < row || (MC.cur[mid].row == row && MC.cur[mid].col < col)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void multiToggle(int row, int col) {
+    int i = multiFind(row, col);
+    if (i < MC.count && MC.cur[i].row == row && MC.cur[i].col == col) {
+        memmove(&MC.cur[i], &MC.cur[i + 1], sizeof(struct mcursor) * (MC.count - i - 1));
+        MC.count--;
+        return;
+    }
+
+    if (MC.count == MC.cap) {
+        int cap = MC.cap ? MC.cap * 2 : 16;
+        struct mcursor *new = realloc(MC.cur, sizeof(struct mcursor) * cap);
+        if (new == NULL) return;
+        MC.cur = new;
+        MC.cap = cap;
+    }
+    memmove(&MC.cur[i + 1], &MC.cur[i], sizeof(struct mcursor) * (MC.count - i));
+    MC.cur[i].row = row;
+    MC.cur[i].col = col;
+    MC.count++;
+}
+
+void blockBounds(int *top, int *bottom, int *left, int *width) {
+    int row = E.cy - 2 + E.offsetY, col = E.cx - 1;
+    *top = row < MC.blockRow ? row : MC.blockRow;
+    *bottom = row > MC.blockRow ? row : MC.blockRow;
+    *left = col < MC.blockCol ? col : MC.blockCol;
+    *width = abs(col - MC.blockCol);
+}
+
+int rowHasMarks(int row) {
+    if (MC.block) {
+        int top, bottom, left, width;
+        blockBounds(&top, &bottom, &left, &width);
+        return row >= top && row <= bottom;
+    }
+    int i = multiFind(row, 0);
+    return i < MC.count && MC.cur[i].row == row;
+}
+
+int isMarked(int row, int col) {
+    if (MC.block) {
+        int top, bottom, left, width;
+        blockBounds(&top, &bottom, &left, &width);
+        return row >= top && row <= bottom && col >= left && col < left + (width ? width : 1);
+    }
+    int i = multiFind(row, col);
+    return i < MC.count && MC.cur[i].row == row && MC.cur[i].col == col;
+}
+
+// Draw a row with the other cursors and the block in reverse video
+void drawMarkedLine(struct buf *ab, const char *s, int len, int row) {
+    int inverse = 0;
+    for (int i = 0; i <= len && i < E.screencols; i++) {
+        int mark = isMarked(row, i);
+        if (mark != inverse) {
+            bufAppend(ab, mark ? "\x1b[7m" : "\x1b[27m", mark ? 4 : 5);
+            inverse = mark;
+        }
+        if (i < len) bufAppend(ab, &s[i], 1);
+        else if (mark) bufAppend(ab, " ", 1);
+    }
+}
+
+int targetCompare(const void *a, const void *b) {
+    const struct editTarget *x = a, *y = b;
+    if (x->row != y->row) return x->row < y->row ? -1 : 1;
+    return x->col < y->col ? -1 : x->col > y->col;
+}
+
+// Rebuild each affected row once with all of its targets applied, c < 0 only deletes.
+// Afterwards every target's col holds the column its cursor moves to, or -1 if skipped.
+void applyTargets(struct editTarget *t, int n, int c) {
+    W.complete.count = 0;
+    qsort(t, n, sizeof(struct editTarget), targetCompare);
+
+    for (int i = 0; i < n; ) {
+        int r = t[i].row, j = i;
+        while (j < n && t[j].row == r) j++;
+        if (r >= E.numrows) {
+            for (; i < j; i++) t[i].col = -1;
+            continue;
+        }
+
+        erow *row = &E.row[r];
+        const char *src = rowPeek(row);
+        int cap, in = 0, out = 0;
+        char *dst = rowAlloc(row->size + (j - i) + 1, &cap);
+        if (src == NULL || dst == NULL) {
+            rowFree(dst, cap);
+            for (; i < n; i++) t[i].col = -1; // Nothing moves where nothing was edited
+            return;
+        }
+
+        for (; i < j; i++) {
+            int col = t[i].col, del = t[i].del;
+            if (col > row->size) {
+                t[i].col = -1; // Row too short to reach the column
+                continue;
+            }
+            if (col < in) {
+                del -= in - col;
+                col = in;
+            }
+            if (del < 0) del = 0;
+            if (col + del > row->size) del = row->size - col;
+
+            memcpy(&dst[out], &src[in], col - in);
+            out += col - in;
+            in = col + del;
+            if (c >= 0) dst[out++] = c;
+            t[i].col = out;
+        }
+        memcpy(&dst[out], &src[in], row->size - in);
+        out += row->size - in;
+        dst[out] = '\0';
+
+        indexWords(src, row->size, -1);
+        indexWords(dst, out, 1);
+        coldRelease(row);
+        rowFree(row->chars, row->cap);
+        row->chars = dst;
+        row->cap = cap;
+        row->size = out;
+        rowTouch(row);
+    }
+}
+
+// Apply a typed character, BACKSPACE or DEL_KEY at every cursor or block row
+void multiEdit(int c) {
+    int row = E.cy - 2 + E.offsetY, col = E.cx - 1;
+    int n = 0;
+    int insert = c == BACKSPACE || c == DEL_KEY ? -1 : c;
+    struct editTarget *t;
+
+    if (MC.block) {
+        int top, bottom, left, width;
+        blockBounds(&top, &bottom, &left, &width);
+        t = malloc(sizeof(struct editTarget) * (bottom - top + 1));
+        if (t == NULL) return;
+
+        for (int r = top; r <= bottom; r++) {
+            struct editTarget e = {r, left, width, r == row ? -1 : -2};
+            if (width == 0 && c == BACKSPACE) {
+                if (left == 0) continue;
+                e.col--;
+                e.del = 1;
+            } else if (width == 0 && c == DEL_KEY) e.del = 1;
+            t[n++] = e;
+        }
+    } else {
+        t = malloc(sizeof(struct editTarget) * (MC.count + 1));
+        if (t == NULL) return;
+
+        for (int i = -1; i < MC.count; i++) {
+            struct editTarget e = {row, col, 0, -1};
+            if (i >= 0) {
+                if (MC.cur[i].row == row && MC.cur[i].col == col) continue;
+                e.row = MC.cur[i].row;
+                e.col = MC.cur[i].col;
+                e.who = i;
+            }
+            if (c == BACKSPACE) {
+                if (e.col == 0) continue;
+                e.col--;
+                e.del = 1;
+            } else if (c == DEL_KEY) e.del = 1;
+            t[n++] = e;
+        }
+    }
+
+    applyTargets(t, n, insert);
+
+    for (int i = 0; i < n; i++) {
+        if (t[i].col < 0) continue;
+        if (t[i].who == -1) E.cx = t[i].col + 1;
+        else if (t[i].who >= 0) MC.cur[t[i].who].col = t[i].col;
+    }
+    if (MC.block) MC.blockCol = E.cx - 1;
+    free(t);
+
+    // Cursors that deleted into each other become one
+    int kept = 0;
+    for (int i = 0; i < MC.count; i++) {
+        if (kept > 0 && MC.cur[kept - 1].row == MC.cur[i].row && MC.cur[kept - 1].col == MC.cur[i].col) continue;
+        MC.cur[kept++] = MC.cur[i];
+    }
+    MC.count = kept;
 }
 
 //*** editor ***//
@@ -198,6 +1519,7 @@ void moveCursor(int key) {
 }
 
 void drawFileLine(struct buf *ab, int y) {
+    rowInflate(&E.row[y-1 + E.offsetY]);
     int len = E.row[y-1 + E.offsetY].size;
     if (len > E.screencols) len = E.screencols;
 
@@ -223,7 +1545,10 @@ void drawFileLine(struct buf *ab, int y) {
     */
     
     // Entire line print:
-    bufAppend(ab, E.row[y-1 + E.offsetY].chars, len);
+    if (multiActive() && E.insert && rowHasMarks(y-1 + E.offsetY))
+        drawMarkedLine(ab, E.row[y-1 + E.offsetY].chars, len, y-1 + E.offsetY);
+    else
+        bufAppend(ab, E.row[y-1 + E.offsetY].chars, len);
 
     E.rowHl = 0;
     bufAppend(ab, "\x1b[m", 3);
@@ -247,15 +1572,17 @@ void drawRows(struct buf *ab) {
             bufAppend(ab, "\x1b[m\r\n", 5);
         }
         
-        else if (y == E.screenrows-2 && E.prompt.b) {
+        else if (y == E.screenrows-2 && E.prompt.len) {
             bufAppend(ab, "\x1b[45m", 5);
-            bufAppend(ab, E.prompt.b, E.prompt.len);
+            bufAppend(ab, E.prompt.b, E.prompt.len < E.screencols ? E.prompt.len : E.screencols); // A wrapped line would scroll the title away
             bufAppend(ab, "\x1b[m\r\n", 5);
         }
         else if (y == E.screenrows-1) {
 
             char info[80];
-            int len = snprintf(info, sizeof(info), "%d lines  Ln %d, Col %d  Scl %d", E.numrows, E.cy, E.cx, E.offsetY);
+            int len;
+            if (H.active) len = snprintf(info, sizeof(info), "%zu bytes  Off 0x%zx  %d changed", H.size, H.cursor, H.numpatches);
+            else len = snprintf(info, sizeof(info), "%d lines  Ln %d, Col %d  Scl %d", E.numrows, E.cy, E.cx, E.offsetY);
             if (len > E.screencols) len = E.screencols;
 
             int i = len + (E.cmd.len != 0 ? E.cmd.len : 51);
@@ -270,6 +1597,11 @@ void drawRows(struct buf *ab) {
             bufAppend(ab, "\x1b[m", 3);
         }
         
+        else if (H.active) {
+            if (hexLineVisible(y)) drawHexLine(ab, y);
+            else bufAppend(ab, "\033[36m~\033[0m\x1b[K\r\n", 15);
+        }
+
         else if ( y <= E.numrows - E.offsetY) {
             char nr[80];
             int len = snprintf(nr, sizeof(nr), "%d", y + E.offsetY);
@@ -286,7 +1618,7 @@ void drawRows(struct buf *ab) {
         }
         
         else {
-            bufAppend(ab, (y < E.screenrows-1) ? "\033[36m~\033[0m\x1b[K\r\n" : "\033[36m~\033[0m", 17);
+            bufAppend(ab, (y < E.screenrows-1) ? "\033[36m~\033[0m\x1b[K\r\n" : "\033[36m~\033[0m", (y < E.screenrows-1) ? 15 : 10);
         }
         bufAppend(ab, "\x1b[K", 3);
     }
@@ -297,44 +1629,94 @@ void drawRows(struct buf *ab) {
 void insertRow(int at, char *s, size_t len) {
     if (at < 0 || at > E.numrows) return;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+    if (E.numrows == E.rowcap) {
+        int rowcap = E.rowcap ? E.rowcap * 2 : 64;
+        erow *new = realloc(E.row, sizeof(erow) * rowcap);
+        if (new == NULL) return;
+        E.row = new;
+        E.rowcap = rowcap;
+    }
     memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
 
     E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
+    E.row[at].chars = rowAlloc(len + 1, &E.row[at].cap);
     memcpy(E.row[at].chars, s, len);
     E.row[at].chars[len] = '\0';
-    E.row[at].hl = NULL;
+    E.row[at].stamp = 0;
 
     E.numrows++;
+    indexWords(E.row[at].chars, len, 1);
 }
 
 void delRow(int at) {
     if (at < 0 || at >= E.numrows) return;
-    free(E.row[at].chars);
+    if (W.built) indexWords(rowPeek(&E.row[at]), E.row[at].size, -1); // Avoids decompressing a cold row for nothing
+    rowFree(E.row[at].chars, E.row[at].cap);
+    coldRelease(&E.row[at]);
     memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
     E.numrows--;
 }
 
-void rowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
+// The row primitives below update the word index for the words around the edit only
+
+void rowInsertString(erow *row, int at, const char *s, int len) {
+    if (at < 0 || at > row->size) at = row->size;
+    rowOwn(row);
+    rowTouch(row);
+
+    int l = at, r = at;
+    wordSpan(row->chars, row->size, &l, &r);
+    indexWords(&row->chars[l], r - l, -1);
+
+    rowReserve(row, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
     row->size += len;
-    row->chars[row->size] = '\0';
+
+    indexWords(&row->chars[l], r - l + len, 1);
+}
+
+void rowDelString(erow *row, int at, int len) {
+    if (at < 0 || len <= 0 || at + len > row->size) return;
+    rowOwn(row);
+    rowTouch(row);
+
+    int l = at, r = at + len;
+    wordSpan(row->chars, row->size, &l, &r);
+    indexWords(&row->chars[l], r - l, -1);
+
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+
+    indexWords(&row->chars[l], r - l - len, 1);
+}
+
+void rowTruncate(erow *row, int size) {
+    if (size < 0 || size >= row->size) return;
+    rowOwn(row);
+    rowTouch(row);
+
+    int l = size, r = size;
+    wordSpan(row->chars, row->size, &l, &r);
+    indexWords(&row->chars[l], row->size - l, -1);
+
+    row->size = size;
+    row->chars[size] = '\0';
+
+    indexWords(&row->chars[l], size - l, 1);
+}
+
+void rowAppendString(erow *row, char *s, size_t len) {
+    rowInsertString(row, row->size, s, len);
 }
 
 void rowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
+    char ch = c;
+    rowInsertString(row, at, &ch, 1);
 }
 
 void rowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
+    rowDelString(row, at, 1);
 }
 
 
@@ -348,11 +1730,11 @@ void insertNewline() {
         insertRow(E.cy - 1 + E.offsetY, "", 0);
     } else {
         erow *row = &E.row[E.cy - 2 + E.offsetY];
+        rowOwn(row);
         insertRow(E.cy - 1 + E.offsetY, &row->chars[E.cx - 1], row->size - E.cx + 1);
-        row = &E.row[E.cy - 2 + E.offsetY];
-        row->size = E.cx - 1;
-        row->chars[row->size] = '\0';
+        rowTruncate(&E.row[E.cy - 2 + E.offsetY], E.cx - 1);
     }
+    rowTouch(&E.row[E.cy - 1 + E.offsetY]);
     if (E.cy + 1 >= E.screenrows - 5) {
         E.offsetY++;
     } else E.cy++;
@@ -365,6 +1747,7 @@ void delChar() {
     else if (E.cx == 1 && E.cy <= 2) { E.offsetY--; E.cy++; }
 
     erow *row = &E.row[E.cy - 2 + E.offsetY];
+    rowOwn(row);
     if (E.cx > 1) {
         rowDelChar(row, E.cx - 2);
         E.cx--;
@@ -376,33 +1759,589 @@ void delChar() {
     }
 }
 
+//*** line ranges ***//
+
+int viewCompare(const struct rowView *a, const struct rowView *b) {
+    int n = a->size < b->size ? a->size : b->size;
+    int c = memcmp(a->chars, b->chars, n);
+    return c ? c : a->size - b->size;
+}
+
+void mergeRuns(struct rowView **a, struct rowView **tmp, int lo, int mid, int hi) {
+    int i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) tmp[k++] = viewCompare(a[j], a[i]) < 0 ? a[j++] : a[i++];
+    while (i < mid) tmp[k++] = a[i++];
+    while (j < hi) tmp[k++] = a[j++];
+    memcpy(&a[lo], &tmp[lo], sizeof(struct rowView *) * (hi - lo));
+}
+
+void mergeSortRows(struct rowView **a, struct rowView **tmp, int lo, int hi) {
+    if (hi - lo <= 16) {
+        for (int i = lo + 1; i < hi; i++) {
+            struct rowView *r = a[i];
+            int j = i;
+            for (; j > lo && viewCompare(r, a[j - 1]) < 0; j--) a[j] = a[j - 1];
+            a[j] = r;
+        }
+        return;
+    }
+
+    int mid = lo + (hi - lo) / 2;
+    mergeSortRows(a, tmp, lo, mid);
+    mergeSortRows(a, tmp, mid, hi);
+    if (viewCompare(a[mid - 1], a[mid]) > 0) mergeRuns(a, tmp, lo, mid, hi);
+}
+
+void *sortWorker(void *arg) {
+    struct sortJob *job = arg;
+    if (job->mid < 0) mergeSortRows(job->a, job->tmp, job->lo, job->hi);
+    else mergeRuns(job->a, job->tmp, job->lo, job->mid, job->hi);
+    return NULL;
+}
+
+// Run the jobs on their own threads, falling back to this one
+void runSortJobs(struct sortJob *jobs, int n) {
+    pthread_t th[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS];
+
+    for (int i = 0; i < n; i++) {
+        started[i] = pthread_create(&th[i], NULL, sortWorker, &jobs[i]) == 0;
+        if (!started[i]) sortWorker(&jobs[i]);
+    }
+    for (int i = 0; i < n; i++)
+        if (started[i]) pthread_join(th[i], NULL);
+}
+
+// Stable parallel merge sort of the view pointers
+int sortRowPointers(struct rowView **a, int n) {
+    struct rowView **tmp = malloc(sizeof(struct rowView *) * n);
+    if (tmp == NULL) return -1;
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > SORT_MAX_THREADS) threads = SORT_MAX_THREADS;
+    if (threads > n / SORT_MIN_ROWS) threads = n / SORT_MIN_ROWS;
+    if (threads < 1) threads = 1;
+
+    int bounds[SORT_MAX_THREADS + 1];
+    struct sortJob jobs[SORT_MAX_THREADS];
+    for (int i = 0; i <= threads; i++) bounds[i] = (long) n * i / threads;
+
+    for (int i = 0; i < threads; i++) {
+        jobs[i].a = a; jobs[i].tmp = tmp;
+        jobs[i].lo = bounds[i]; jobs[i].mid = -1; jobs[i].hi = bounds[i + 1];
+    }
+    runSortJobs(jobs, threads);
+
+    for (int width = 1; width < threads; width *= 2) {
+        int count = 0;
+        for (int i = 0; i + width < threads; i += 2 * width) {
+            jobs[count].a = a; jobs[count].tmp = tmp;
+            jobs[count].lo = bounds[i];
+            jobs[count].mid = bounds[i + width];
+            jobs[count].hi = bounds[i + 2 * width < threads ? i + 2 * width : threads];
+            count++;
+        }
+        runSortJobs(jobs, count);
+    }
+
+    free(tmp);
+    return 0;
+}
+
+// Sort rows [from, to) by moving the row entries, compressed rows are then packed
+// into new blocks in their sorted order
+int sortRows(int from, int to) {
+    W.complete.count = 0;
+    int n = to - from, ret = -1;
+    erow *base = &E.row[from];
+    struct scratch scratch = SCRATCH_INIT;
+    struct rowView *views = malloc(sizeof(struct rowView) * n);
+    struct rowView **ptrs = malloc(sizeof(struct rowView *) * n);
+    struct rowView *sorted = malloc(sizeof(struct rowView) * n);
+
+    if (views && ptrs && sorted && rowViews(from, to, views, &scratch) == 0) {
+        for (int i = 0; i < n; i++) ptrs[i] = &views[i];
+        ret = sortRowPointers(ptrs, n);
+        for (int i = 0; ret == 0 && i < n; i++) sorted[i] = *ptrs[i];
+    }
+
+    // Apply the permutation in place, one cycle at a time
+    for (int i = 0; ret == 0 && i < n; i++) {
+        if (ptrs[i] == NULL) continue;
+        erow save = base[i];
+        int j = i;
+        while (1) {
+            int k = ptrs[j] - views;
+            ptrs[j] = NULL;
+            if (k == i) {
+                base[j] = save;
+                break;
+            }
+            base[j] = base[k];
+            j = k;
+        }
+    }
+    if (ret == 0) repackRows(from, to, sorted);
+
+    free(views);
+    free(ptrs);
+    free(sorted);
+    free(scratch.b);
+    return ret;
+}
+
+// Drop repeated adjacent rows in [from, to), returns how many were removed.
+// A row that cannot be read back is kept and nothing is compared with it
+int uniqRows(int from, int to) {
+    W.complete.count = 0;
+    struct buf kept = BUF_INIT; // Copy of the last kept row, rowPeek() may reuse its memory
+    int w = from, have = 0;
+    for (int i = from; i < to; i++) {
+        erow *row = &E.row[i];
+        const char *text = rowPeek(row);
+        if (text && have && kept.len == row->size && memcmp(kept.b, text, row->size) == 0) {
+            indexWords(text, row->size, -1);
+            rowFree(row->chars, row->cap);
+            coldRelease(row);
+            continue;
+        }
+        bufReset(&kept);
+        if (text) bufAppend(&kept, text, row->size);
+        have = text && kept.len == row->size;
+        E.row[w++] = *row;
+    }
+    bufFree(&kept);
+
+    int removed = to - w;
+    memmove(&E.row[w], &E.row[to], sizeof(erow) * (E.numrows - to));
+    E.numrows -= removed;
+    return removed;
+}
+
+// Cut the rows down to whitespace separated fields first to last, counting from 1
+int cutRows(int from, int to, int first, int last) {
+    W.complete.count = 0;
+    int ret = 0;
+    for (int i = from; i < to; i++) {
+        erow *row = &E.row[i];
+        const char *text = rowPeek(row);
+        if (text == NULL) {
+            ret = -1; // A compressed block could not be read back, leave the row as it is
+            continue;
+        }
+        int start = row->size, end = row->size;
+        int field = 0, j = 0;
+
+        while (j < row->size) {
+            while (j < row->size && (text[j] == ' ' || text[j] == '\t')) j++;
+            if (j == row->size) break;
+            field++;
+            if (field == first) start = j;
+            while (j < row->size && text[j] != ' ' && text[j] != '\t') j++;
+            if (field >= first) end = j;
+            if (field == last) break;
+        }
+        if (start == row->size) end = start;
+
+        indexWords(text, row->size, -1);
+        indexWords(&text[start], end - start, 1);
+        rowTouch(row);
+
+        // A compressed or mapped row can just point at the part it keeps
+        if (rowBlock(row)) rowSetBlock(row, rowBlock(row), rowBlockOffset(row) + start);
+        else if (row->cap == 0) row->chars += start;
+        else {
+            memmove(row->chars, &row->chars[start], end - start);
+            row->chars[end - start] = '\0';
+        }
+        row->size = end - start;
+    }
+    return ret;
+}
+
+//*** index cache ***//
+
+int cacheEnabled() {
+    return getenv("JAKK_NOCACHE") == NULL;
+}
+
+// Cache file for a path, named by a hash of the resolved path, which is stored in real
+int cachePath(const char *filename, char *real, char *path, int create) {
+    if (realpath(filename, real) == NULL) return -1;
+
+    char dir[PATH_MAX - 32];
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base && *base) snprintf(dir, sizeof(dir), "%s/jakk", base);
+    else if (getenv("HOME")) snprintf(dir, sizeof(dir), "%s/.cache/jakk", getenv("HOME"));
+    else return -1;
+
+    if (create) {
+        char *slash = strrchr(dir, '/');
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+        if (mkdir(dir, 0700) == -1 && access(dir, W_OK) != 0) return -1;
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *p = real; *p; p++) hash = (hash ^ (unsigned char) *p) * 1099511628211ull;
+
+    snprintf(path, PATH_MAX, "%s/%016llx.idx", dir, (unsigned long long) hash);
+    return 0;
+}
+
+int cacheMatches(struct cacheHeader *h, struct stat *st) {
+    return !memcmp(h->magic, CACHE_MAGIC, 8)
+        && h->size == (uint64_t) st->st_size
+        && h->mtime == st->st_mtim.tv_sec
+        && h->mtimeNsec == st->st_mtim.tv_nsec
+        && h->ino == st->st_ino
+        && h->dev == st->st_dev;
+}
+
+int indexAdd(struct lineIndex *idx, uint64_t off, uint32_t len) {
+    if (idx->count == idx->cap) {
+        int cap = idx->cap ? idx->cap * 2 : 1024;
+        uint64_t *o = realloc(idx->off, sizeof(uint64_t) * cap);
+        if (o == NULL) return -1;
+        idx->off = o;
+        uint32_t *l = realloc(idx->len, sizeof(uint32_t) * cap);
+        if (l == NULL) return -1;
+        idx->len = l;
+        idx->cap = cap;
+    }
+    idx->off[idx->count] = off;
+    idx->len[idx->count] = len;
+    idx->count++;
+    return 0;
+}
+
+void writeCache(const char *filename, struct stat *st, struct lineIndex *idx) {
+    char real[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX + 8];
+    if (cachePath(filename, real, path, 1) == -1) return;
+
+    struct cacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, 8);
+    h.size = st->st_size;
+    h.mtime = st->st_mtim.tv_sec;
+    h.mtimeNsec = st->st_mtim.tv_nsec;
+    h.ino = st->st_ino;
+    h.dev = st->st_dev;
+    h.numrows = idx->count;
+    h.cx = 1; h.cy = 2;
+    h.pathLen = strlen(real);
+
+    // Write aside and rename, so a reader never sees a half written index
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) return;
+
+    static const char pad[8];
+    size_t head = sizeof(h) + h.pathLen;
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1
+        && fwrite(real, 1, h.pathLen, fp) == (size_t) h.pathLen
+        && fwrite(pad, 1, (8 - head % 8) % 8, fp) == (8 - head % 8) % 8
+        && fwrite(idx->off, sizeof(uint64_t), idx->count, fp) == (size_t) idx->count
+        && fwrite(idx->len, sizeof(uint32_t), idx->count, fp) == (size_t) idx->count;
+
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return;
+    }
+
+    free(E.cacheFile);
+    E.cacheFile = strdup(path);
+}
+
+// Map an unchanged file and build its rows from the cached index, without reading it
+int openCached(const char *filename) {
+    char real[PATH_MAX], path[PATH_MAX];
+    struct stat st, cst;
+
+    if (!cacheEnabled() || cachePath(filename, real, path, 0) == -1) return -1;
+
+    int cfd = open(path, O_RDONLY);
+    if (cfd == -1) return -1;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || fstat(cfd, &cst) == -1 || (size_t) cst.st_size < sizeof(struct cacheHeader)) {
+        if (fd != -1) close(fd);
+        close(cfd);
+        return -1;
+    }
+
+    char *cache = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+    close(cfd);
+    if (cache == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    struct cacheHeader h;
+    memcpy(&h, cache, sizeof(h));
+    size_t head = sizeof(h) + h.pathLen;
+    head += (8 - head % 8) % 8;
+
+    if (!cacheMatches(&h, &st) || h.numrows <= 0 || h.numrows > INT_MAX
+        || (size_t) h.pathLen != strlen(real) || memcmp(cache + sizeof(h), real, h.pathLen)
+        || (size_t) cst.st_size != head + h.numrows * (sizeof(uint64_t) + sizeof(uint32_t))) {
+        munmap(cache, cst.st_size);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    E.row = malloc(sizeof(erow) * h.numrows);
+    if (E.map == MAP_FAILED || E.row == NULL) {
+        if (E.map != MAP_FAILED) munmap(E.map, st.st_size);
+        E.map = NULL;
+        free(E.row);
+        E.row = NULL;
+        munmap(cache, cst.st_size);
+        return -1;
+    }
+    E.mapSize = st.st_size;
+
+    uint64_t *off = (uint64_t *) (cache + head);
+    uint32_t *len = (uint32_t *) (cache + head + h.numrows * sizeof(uint64_t));
+    for (int i = 0; i < h.numrows; i++) {
+        // An index that still matches the header can be damaged anywhere else
+        if (len[i] > INT_MAX || off[i] > (uint64_t) st.st_size || len[i] > st.st_size - off[i]) {
+            munmap(E.map, E.mapSize);
+            E.map = NULL;
+            E.mapSize = 0;
+            free(E.row);
+            E.row = NULL;
+            munmap(cache, cst.st_size);
+            unlink(path);
+            return -1;
+        }
+        erow *row = &E.row[i];
+        row->size = len[i];
+        row->cap = 0;
+        row->chars = E.map + off[i];
+        row->stamp = 0;
+    }
+    E.numrows = E.rowcap = h.numrows;
+    munmap(cache, cst.st_size);
+
+    E.offsetY = h.offsetY >= 0 && h.offsetY < E.numrows ? h.offsetY : 0;
+    E.cy = h.cy;
+    if (E.cy < 2 || E.cy >= E.screenrows - 4 || E.cy - 2 + E.offsetY >= E.numrows) E.cy = 2;
+    E.cx = h.cx;
+    if (E.cx < 1 || E.cx > E.row[E.cy - 2 + E.offsetY].size + 1) E.cx = 1;
+
+    E.cacheFile = strdup(path);
+    return 0;
+}
+
+// Remember where the cursor was, as long as the index still matches the file
+void saveCachePosition() {
+    if (E.cacheFile == NULL || E.filename == NULL) return;
+
+    struct stat st;
+    struct cacheHeader h;
+    int fd = open(E.cacheFile, O_RDWR);
+    if (fd == -1) return;
+
+    if (stat(E.filename, &st) == 0 && read(fd, &h, sizeof(h)) == sizeof(h) && cacheMatches(&h, &st)) {
+        h.cx = E.insert ? E.cx : saveX;
+        h.cy = E.insert ? E.cy : saveY;
+        h.offsetY = E.offsetY;
+        pwrite(fd, &h, sizeof(h), 0);
+    }
+    close(fd);
+}
+
+void discardCache() {
+    if (E.cacheFile == NULL) return;
+    unlink(E.cacheFile);
+    free(E.cacheFile);
+    E.cacheFile = NULL;
+}
+
+//*** read-only buffers ***//
+
+// Point every row at text that outlives the buffer, nothing is copied
+int borrowRows(const struct staticRow *lines, int n) {
+    E.row = malloc(sizeof(erow) * (n > 0 ? n : 1));
+    if (E.row == NULL) return -1;
+
+    for (int i = 0; i < n; i++) {
+        erow *row = &E.row[i];
+        row->size = lines[i].size;
+        row->cap = 0;
+        row->chars = (char *) lines[i].chars;
+        row->stamp = 0;
+    }
+    E.numrows = E.rowcap = n;
+    E.readOnly = 1;
+    return 0;
+}
+
+// Split mapped text into borrowed rows with one pass of memchr
+int mapRows(const char *data, size_t len) {
+    struct staticRow *lines = NULL;
+    int n = 0, cap = 0;
+    const char *p = data, *end = data + len;
+
+    while (p < end || n == 0) {
+        const char *nl = p < end ? memchr(p, '\n', end - p) : NULL;
+        const char *stop = nl ? nl : end;
+        if (stop > p && stop[-1] == '\r') stop--;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            struct staticRow *new = realloc(lines, sizeof(struct staticRow) * cap);
+            if (new == NULL) {
+                free(lines);
+                return -1;
+            }
+            lines = new;
+        }
+        lines[n].chars = p;
+        lines[n].size = stop - p;
+        n++;
+        p = nl ? nl + 1 : end;
+    }
+
+    int ret = borrowRows(lines, n);
+    free(lines);
+    return ret;
+}
+
+// Open a file read-only with its rows pointing into a private mapping of it
+int openView(const char *filename) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    char *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    if (mapRows(map ? map : "", st.st_size) == -1) {
+        if (map) munmap(map, st.st_size);
+        return -1;
+    }
+    E.map = map;
+    E.mapSize = st.st_size;
+    E.cx = 1; E.cy = 2;
+    E.offsetY = 0;
+    return 0;
+}
+
 //*** file ***//
 
+// The editor keeps its own copy, arguments may point into the reused command buffer
+void setFilename(const char *filename) {
+    char *copy = filename ? strdup(filename) : NULL;
+    free(E.filename);
+    E.filename = copy;
+}
+
+int readFull(int fd, void *p, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = read(fd, (char *) p + done, len - done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int writeFull(int fd, const void *p, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, (const char *) p + done, len - done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
 void openFile(char *filename) {
-    E.filename = filename;
+    setFilename(filename);
+    E.readOnly = 0;
+    E.coldY = 0;
+    if (openCached(filename) == 0) return;
+
     FILE *fp = fopen(filename, "r");
     char *line = NULL;
     size_t linecap = 0;
     ssize_t linelen;
+
+    struct stat st;
+    struct lineIndex idx = {NULL, NULL, 0, 0};
+    uint64_t pos = 0;
+    int indexing = cacheEnabled() && fstat(fileno(fp), &st) == 0 && st.st_size >= CACHE_MIN_SIZE;
+
     while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        uint64_t start = pos;
+        pos += linelen;
         while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
         insertRow(E.numrows, line, linelen);
+        if (indexing && indexAdd(&idx, start, linelen) == -1) indexing = 0;
+
+        // Compress while loading so large files never sit in memory uncompressed
+        if (E.numrows % COLD_BLOCK_ROWS == 0 && E.numrows >= E.screenrows + COLD_MARGIN + COLD_BLOCK_ROWS)
+            compressRows(E.numrows - COLD_BLOCK_ROWS, E.numrows);
     }
 
     free(line);
     fclose(fp);
 
+    if (indexing && E.numrows > 0) writeCache(filename, &st, &idx);
+    free(idx.off);
+    free(idx.len);
+
     E.cx = 1; E.cy = 2;
     E.offsetY = 0;
-    E.readOnly = 0;
 }
 
 void closeFile() {
+    hexClose();
+    multiClear();
+    saveCachePosition();
+    free(E.cacheFile);
+    E.cacheFile = NULL;
+
+    for (int i = 0; i < E.numrows; i++) {
+        rowFree(E.row[i].chars, E.row[i].cap);
+        coldRelease(&E.row[i]);
+    }
+    free(E.row);
+    slabRelease();
+
+    if (E.map) munmap(E.map, E.mapSize);
+    E.map = NULL;
+    E.mapSize = 0;
+
     E.cx = 1; E.cy = 2;
     E.offsetY = 0;
     E.row = NULL;
     E.numrows = 0;
-    E.filename = NULL;
+    E.rowcap = 0;
+    setFilename(NULL);
+    wordIndexReset();
+}
+
+// Open binary files in the hex view and everything else as text
+void openPath(char *filename) {
+    if (isBinaryFile(filename) && openHex(filename) == 0) {
+        setFilename(filename);
+        E.cx = 1; E.cy = 2;
+        E.offsetY = 0;
+    } else openFile(filename);
 }
 
 void createFile() {
@@ -416,10 +2355,16 @@ char *rowsToString(int *buflen) {
     for (j = 0; j < E.numrows; j++)
         totlen += E.row[j].size + 1;
     *buflen = totlen;
-    char *buf = malloc(totlen);
+    char *buf = malloc(totlen > 0 ? totlen : 1);
+    if (buf == NULL) return NULL;
     char *p = buf;
     for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
+        const char *text = rowPeek(&E.row[j]);
+        if (text == NULL) {
+            free(buf);
+            return NULL; // A compressed block could not be read back
+        }
+        memcpy(p, text, E.row[j].size);
         p += E.row[j].size;
         *p = '\n';
         p++;
@@ -427,23 +2372,101 @@ char *rowsToString(int *buflen) {
     return buf;
 }
 
-void save() {
-    if (E.filename == NULL) E.filename = "unnamed";
+// Renaming a new copy over the file is only safe for a plain file of ours in a directory we
+// can write to, anything else (links, other owners) would not survive it
+int replaceable(const char *filename, char *real) {
+    struct stat st;
+    char dir[PATH_MAX];
+
+    if (realpath(filename, real) == NULL || stat(real, &st) == -1) return 0;
+    if (!S_ISREG(st.st_mode) || st.st_nlink > 1 || st.st_uid != geteuid()) return 0;
+
+    strcpy(dir, real);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+    return access(dir, W_OK) == 0;
+}
+
+// Carry extended attributes over to the replacement, as far as we may set them
+void copyXattrs(const char *from, int fd) {
+    ssize_t len = listxattr(from, NULL, 0);
+    if (len <= 0) return;
+    char *names = malloc(len);
+    if (names == NULL || (len = listxattr(from, names, len)) <= 0) {
+        free(names);
+        return;
+    }
+
+    for (char *name = names; name < names + len; name += strlen(name) + 1) {
+        ssize_t size = getxattr(from, name, NULL, 0);
+        char *value = size >= 0 ? malloc(size + 1) : NULL;
+        if (value && (size = getxattr(from, name, value, size)) >= 0) fsetxattr(fd, name, value, size, 0);
+        free(value);
+    }
+    free(names);
+}
+
+// Give rows borrowed from the mapped file their own copy, so the file can be rewritten in place
+int unmapRows() {
+    for (int i = 0; i < E.numrows; i++) {
+        erow *row = &E.row[i];
+        if (row->cap != 0 || row->chars < E.map || row->chars > E.map + E.mapSize) continue;
+        rowReserve(row, row->size + 1);
+        if (row->cap == 0) return -1;
+    }
+    munmap(E.map, E.mapSize);
+    E.map = NULL;
+    E.mapSize = 0;
+    return 0;
+}
+
+// Returns -1 and leaves the file alone if the buffer could not be put together
+int save() {
+    if (E.filename == NULL) setFilename("unnamed");
     int len;
     char *buf = rowsToString(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    ftruncate(fd, len);
-    write(fd, buf, len);
-    close(fd);
+    if (buf == NULL) return -1;
+
+    char real[PATH_MAX];
+    if (E.map && replaceable(E.filename, real)) {
+        // Rows still point into the mapped file, so replace it instead of rewriting it in place
+        char tmp[PATH_MAX + 8];
+        struct stat st;
+        snprintf(tmp, sizeof(tmp), "%s.jakk~", real);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        int ok = fd != -1
+            && stat(real, &st) == 0 && fchmod(fd, st.st_mode & 07777) == 0
+            && writeFull(fd, buf, len) == 0;
+        if (ok) copyXattrs(real, fd);
+        if (fd != -1 && close(fd) == -1) ok = 0;
+
+        // Only replace the original once the new copy is complete
+        if (!ok || rename(tmp, real) == -1) {
+            if (fd != -1) unlink(tmp);
+            free(buf);
+            return -1;
+        }
+    } else {
+        if (E.map && unmapRows() == -1) {
+            free(buf);
+            return -1;
+        }
+        int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+        ftruncate(fd, len);
+        write(fd, buf, len);
+        close(fd);
+    }
+    discardCache();
     free(buf);
+    return 0;
 }
 
 //*** operation modes ***//
 
-int saveX, saveY;
 void setInsert(int posX, int posY ) {
     E.cx = posX; E.cy = posY;
-    bufFree(&E.cmd);
+    bufReset(&E.cmd);
     E.insert = 1;
 }
 void unsetInsert() {
@@ -461,12 +2484,29 @@ void print(char *str) {
 void openCommand(char *arg) {
     if (access(arg, F_OK) == 0) {
         closeFile();
-        openFile(arg);
-        saveX = 1; saveY = 2;
+        openPath(arg);
+        saveX = E.cx; saveY = E.cy;
         setInsert(saveX, saveY);
     } else bufAppend(&E.prompt, "Error: File does not exist.", 21);
 }
 
+void viewCommand(char *arg) {
+    if (access(arg, R_OK) == -1) {
+        print("Error: File does not exist.");
+        return;
+    }
+    closeFile();
+    if (openView(arg) == 0) {
+        setFilename(arg);
+        print("Success: File opened read-only.");
+    } else {
+        createFile();
+        print("Error: File could not be mapped.");
+    }
+    saveX = E.cx; saveY = E.cy;
+    setInsert(saveX, saveY);
+}
+
 void closeCommand() {
     closeFile();
     createFile();
@@ -475,16 +2515,31 @@ void closeCommand() {
 }
 
 void renameCommand(char *arg) {
-    E.filename = arg;
+    setFilename(arg);
 }
 
-void saveCommand(char *arg) {
+int saveCommand(char *arg) {
     if(E.readOnly) {
         bufAppend(&E.prompt, "Error: This file is read-only!", 24);
-        return;
+        return -1;
+    }
+    if (H.active) {
+        if (arg) {
+            bufAppend(&E.prompt, "Error: Hex view saves in place only.", 36);
+            return -1;
+        }
+        if (hexSave() == -1) {
+            print("Error: File could not be saved.");
+            return -1;
+        }
+        return 0;
     }
-    if(arg) E.filename = arg;
-    save();
+    if(arg) setFilename(arg);
+    if (save() == -1) {
+        print("Error: File could not be saved.");
+        return -1;
+    }
+    return 0;
 }
 
 void moveCommand() {
@@ -492,24 +2547,184 @@ void moveCommand() {
 } 
 
 void startCommand() {
+    if (H.active) hexMoveTo(H.cursor - H.cursor % HEX_WIDTH);
     setInsert(1, E.insert ? E.cy : saveY);
 }
 
 void endCommand() {
+    if (H.active) {
+        hexMoveTo(H.cursor - H.cursor % HEX_WIDTH + HEX_WIDTH - 1);
+        setInsert(1, E.insert ? E.cy : saveY);
+        return;
+    }
     setInsert((E.row[E.cy - 2 + E.offsetY].size + 1), E.insert ? E.cy : saveY);
 }
 
+// Complete the word left of the cursor, repeating cycles through the candidates
+void completeWord() {
+    struct completion *k = &W.complete;
+    int at = E.cy - 2 + E.offsetY;
+    if (at >= E.numrows) return;
+    erow *row = &E.row[at];
+
+    if (k->count && k->row == at && k->at + k->inserted == E.cx - 1) {
+        rowDelString(row, k->at, k->inserted);
+        E.cx -= k->inserted;
+        k->current = (k->current + 1) % k->count;
+    } else {
+        rowOwn(row);
+        int start = E.cx - 1;
+        while (start > 0 && isWordChar(row->chars[start - 1])) start--;
+        if (start == E.cx - 1) {
+            k->count = 0;
+            print("Nothing to complete.");
+            return;
+        }
+
+        if (!W.built) {
+            struct timespec t;
+            char msg[80];
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            buildWordIndex();
+            snprintf(msg, sizeof(msg), "Indexed %d rows in %.0f ms. ", E.numrows, elapsedMs(&t));
+            print(msg);
+        }
+
+        lookupWords(&row->chars[start], E.cx - 1 - start);
+        if (k->count == 0) {
+            print("No completions found.");
+            return;
+        }
+        k->row = at;
+        k->prefix = E.cx - 1 - start;
+        k->at = E.cx - 1;
+        k->current = 0;
+    }
+
+    char *word = k->word[k->current];
+    k->inserted = strlen(word) - k->prefix;
+    rowInsertString(row, k->at, &word[k->prefix], k->inserted);
+    E.cx += k->inserted;
+}
+
+// Parse "from,to" into rows [from, to), the whole file without a range
+int parseRange(char *arg, int *from, int *to) {
+    *from = 0;
+    *to = E.numrows;
+    if (arg == NULL) return 0;
+
+    int a, b;
+    if (sscanf(arg, "%d,%d", &a, &b) != 2 || a < 1 || b < a || a > E.numrows) return -1;
+    *from = a - 1;
+    *to = b < E.numrows ? b : E.numrows;
+    return 0;
+}
+
+// Keep the saved cursor inside the file after rows were removed
+void clampCursor() {
+    if (E.offsetY >= E.numrows) E.offsetY = E.numrows > 0 ? E.numrows - 1 : 0;
+    if (saveY - 2 + E.offsetY >= E.numrows) saveY = E.numrows - E.offsetY + 1;
+    if (saveY < 2) saveY = 2;
+    if (E.numrows && saveX > E.row[saveY - 2 + E.offsetY].size + 1) saveX = E.row[saveY - 2 + E.offsetY].size + 1;
+}
+
+void sortCommand(char *arg) {
+    int from, to;
+    struct timespec t;
+    char msg[80];
+
+    if (parseRange(arg, &from, &to) == -1) {
+        print("Invalid option: Range must be <from>,<to>.");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if (sortRows(from, to) == -1) {
+        print("Error: Not enough memory to sort.");
+        return;
+    }
+    E.coldY = -1; // Rows have moved relative to the viewport, look for cold ones again
+    snprintf(msg, sizeof(msg), "Success: Sorted %d lines in %.0f ms.", to - from, elapsedMs(&t));
+    print(msg);
+}
+
+void uniqCommand(char *arg) {
+    int from, to;
+    struct timespec t;
+    char msg[80];
+
+    if (parseRange(arg, &from, &to) == -1) {
+        print("Invalid option: Range must be <from>,<to>.");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    int removed = uniqRows(from, to);
+    E.coldY = -1;
+    clampCursor();
+    snprintf(msg, sizeof(msg), "Success: Removed %d duplicate lines in %.0f ms.", removed, elapsedMs(&t));
+    print(msg);
+}
+
+void cutCommand(char *fields, char *range) {
+    int from, to, first, last;
+    struct timespec t;
+    char msg[80];
+
+    int n = sscanf(fields, "%d-%d", &first, &last);
+    if (n == 1) last = first;
+    if (n < 1 || first < 1 || last < first) {
+        print("Invalid option: Fields must be <field> or <first>-<last>.");
+        return;
+    }
+    if (parseRange(range, &from, &to) == -1) {
+        print("Invalid option: Range must be <from>,<to>.");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    int ret = cutRows(from, to, first, last);
+    clampCursor();
+    if (ret == -1) {
+        print("Error: Some lines could not be read and were not cut.");
+        return;
+    }
+    snprintf(msg, sizeof(msg), "Success: Cut %d lines in %.0f ms.", to - from, elapsedMs(&t));
+    print(msg);
+}
+
+void multiToggleCursor() {
+    char msg[80];
+    MC.block = 0;
+    multiToggle(E.cy - 2 + E.offsetY, E.cx - 1);
+    snprintf(msg, sizeof(msg), "%d extra cursors.", MC.count);
+    print(msg);
+}
+
+void multiToggleBlock() {
+    multiClear();
+    MC.block = 1;
+    MC.blockRow = E.cy - 2 + E.offsetY;
+    MC.blockCol = E.cx - 1;
+    print("Block selection: move to span lines and columns, CTRL_V again to stop.");
+}
+
 void topCommand() {
+    if (H.active) hexMoveTo(0);
     E.offsetY = 0;
     setInsert(saveX, saveY);
 }
 
 void bottomCommand() {
-    if (E.numrows > E.screenrows) E.offsetY = E.numrows - E.screenrows + 2;
+    if (H.active) hexMoveTo(H.size);
+    else if (E.numrows > E.screenrows) E.offsetY = E.numrows - E.screenrows + 2;
     setInsert(saveX, saveY);
 }
 
 void upCommand() {
+    if (H.active) {
+        size_t page = (size_t) hexRows() * HEX_WIDTH;
+        hexMoveTo(H.cursor > page ? H.cursor - page : 0);
+        setInsert(saveX, saveY);
+        return;
+    }
     if (E.offsetY > 5) E.offsetY-=5;
     else E.offsetY = 0;
 
@@ -520,6 +2735,11 @@ void upCommand() {
 }
 
 void downCommand() {
+    if (H.active) {
+        hexMoveTo(H.cursor + (size_t) hexRows() * HEX_WIDTH);
+        setInsert(saveX, saveY);
+        return;
+    }
     if (E.numrows > E.offsetY + E.screenrows) {
         E.offsetY += 5;    
     }
@@ -531,16 +2751,70 @@ void downCommand() {
 }
 
 void gotoCommand(char *arg) {
+    if (H.active) {
+        hexMoveTo(strtoull(arg, NULL, 0)); // Offsets may be given in hex with 0x
+        setInsert(saveX, saveY);
+        return;
+    }
     int line = atoi(arg);
     E.cx = 1; E.cy = 2;
     E.offsetY = line - 1;
     setInsert(saveX, saveY);
 }
 
+long residentKiB() {
+    long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void statsCommand(char *arg) {
+    char msg[160];
+
+    if (arg && !strcmp(arg, "alloc")) {
+        snprintf(msg, sizeof(msg), "slab %ld chunks, %ld allocs, %ld frees, %ld large | frame %dB, %ld grows/%ld",
+            M.chunks, M.slabAllocs, M.slabFrees, M.largeAllocs, E.frame.cap, M.bufGrows, M.frames);
+        print(msg);
+        return;
+    }
+
+    long hot = 0;
+    for (int i = 0; i < E.numrows; i++) hot += E.row[i].cap > 0 ? E.row[i].cap : 0;
+
+    snprintf(msg, sizeof(msg), "%d rows | %ld cold, %ld blocks, %ldK>%ldK %.1fx | hot %ldK | rss %ldK",
+        E.numrows, M.coldRows, M.coldBlocks, M.coldRaw / 1024, M.coldBytes / 1024,
+        M.coldBytes ? (double) M.coldRaw / M.coldBytes : 1.0, hot / 1024, residentKiB());
+    print(msg);
+}
+
+void hexCommand(char *arg) {
+    char *filename = arg ? arg : E.filename;
+    if (filename == NULL) {
+        print("Invalid option: No file path specified.");
+        return;
+    }
+
+    filename = strdup(filename);
+    closeFile();
+    if (openHex(filename) == 0) {
+        setFilename(filename);
+        print("Success: Showing file as hex.");
+    } else {
+        createFile();
+        print("Error: File could not be opened.");
+    }
+    free(filename);
+    saveX = 1; saveY = 2;
+    setInsert(saveX, saveY);
+}
+
 void helpCommand() {
     closeFile();
-    openFile("./help.txt");
-    E.readOnly = 1;
+    setFilename("help.txt");
+    borrowRows(helpRows, sizeof(helpRows) / sizeof(helpRows[0]));
     saveX = 1; saveY = 2;
     setInsert(saveX, saveY);
 }
@@ -561,7 +2835,13 @@ enum commands {
     TOP, // Move cursor to first position in file
     BOTTOM, // Move screen to end of file
     GOTO,
-    HELP
+    HELP,
+    STATS,
+    SORT,
+    UNIQ,
+    CUT,
+    HEX,
+    VIEW
 };
 
 int getCommand( char *c) {
@@ -593,13 +2873,28 @@ int getCommand( char *c) {
         return GOTO;
     else if(!strcmp(c, "help"))
         return HELP;
+    else if(!strcmp(c, "stats"))
+        return STATS;
+    else if(!strcmp(c, "sort"))
+        return SORT;
+    else if(!strcmp(c, "uniq"))
+        return UNIQ;
+    else if(!strcmp(c, "cut"))
+        return CUT;
+    else if(!strcmp(c, "hex"))
+        return HEX;
+    else if(!strcmp(c, "view"))
+        return VIEW;
     else return 1000;
 
 }
 
 int readKey() {
     char c;
-    while ((read(STDIN_FILENO, &c, 1)) != 1) {}
+    int n;
+    while ((n = read(STDIN_FILENO, &c, 1)) != 1) {
+        if (n == 0 && E.remote) exit(0); // Client went away
+    }
     
     if (c == '\x1b') {
         char seq[3];
@@ -637,34 +2932,115 @@ int readKey() {
     }
 }
 
+void hexKeypress(int c) {
+    switch (c) {
+        case '\x1b':
+            unsetInsert();
+            break;
+
+        case CTRL_KEY('q'):
+            exit(0);
+
+        case CTRL_KEY('s'):
+            if (saveCommand(NULL) == 0) print("Success: File saved.");
+            break;
+
+        case CTRL_KEY('t'):
+            topCommand();
+            break;
+
+        case CTRL_KEY('b'):
+            bottomCommand();
+            break;
+
+        case ARROW_LEFT:
+            if (H.cursor > 0) hexMoveTo(H.cursor - 1);
+            break;
+
+        case ARROW_RIGHT:
+            hexMoveTo(H.cursor + 1);
+            break;
+
+        case ARROW_UP:
+            if (H.cursor >= HEX_WIDTH) hexMoveTo(H.cursor - HEX_WIDTH);
+            break;
+
+        case ARROW_DOWN:
+            if (H.cursor + HEX_WIDTH < H.size) hexMoveTo(H.cursor + HEX_WIDTH);
+            break;
+
+        case HOME_KEY:
+            startCommand();
+            break;
+
+        case END_KEY:
+            endCommand();
+            break;
+
+        case PAGE_UP:
+            upCommand();
+            break;
+
+        case PAGE_DOWN:
+            downCommand();
+            break;
+
+        case '\t':
+            H.text = !H.text;
+            H.nibble = 0;
+            break;
+
+        default:
+            if (!E.readOnly) hexType(c); else print("This file is read-only!");
+            break;
+    }
+}
+
 void processKeypress() {
     int c = readKey();
-    bufFree(&E.prompt);
+    bufReset(&E.prompt);
+    if (c != CTRL_KEY('n')) W.complete.count = 0; // Only back to back presses cycle through completions
 
-    if (E.insert) {
+    if (E.insert && H.active) {
+        hexKeypress(c);
+    } else if (E.insert) {
         switch (c) {
             case '\r':
-                if (!E.readOnly) insertNewline(); else bufAppend(&E.prompt, "This file is read-only!", 24);
+                if (!E.readOnly) {
+                    multiClear();
+                    insertNewline();
+                } else bufAppend(&E.prompt, "This file is read-only!", 24);
                 break;
 
             case BACKSPACE:
             case DEL_KEY:
-                if (!E.readOnly) {
+                if (E.readOnly) print("This file is read-only!");
+                else if (multiActive()) multiEdit(c);
+                else {
                     if (c == DEL_KEY) moveCursor(ARROW_RIGHT);
                     delChar();
-                } else bufAppend(&E.prompt, "This file is read-only!", 24);
+                }
                 break;
 
             case '\x1b':
+                multiClear();
                 unsetInsert();
                 break;
 
+            case CTRL_KEY('a'):
+                multiToggleCursor();
+                break;
+
+            case CTRL_KEY('v'):
+                if (MC.block) multiClear();
+                else multiToggleBlock();
+                break;
+
             case CTRL_KEY('q'):
                 exit(0);
 
             case CTRL_KEY('s'):
-                saveCommand(NULL);
-                print("Success: File saved.");
+                if (saveCommand(NULL) == 0) print("Success: File saved.");
                 break;
 
             case CTRL_KEY('t'):
@@ -675,6 +3051,11 @@ void processKeypress() {
                 bottomCommand();
                 break;
 
+            case CTRL_KEY('n'):
+                multiClear();
+                if (!E.readOnly) completeWord(); else print("This file is read-only!");
+                break;
+
             case ARROW_UP:
             case ARROW_DOWN:
             case ARROW_LEFT:
@@ -702,32 +3083,39 @@ void processKeypress() {
             break;
 
             default:
-                if (!E.readOnly) insertChar(c); else bufAppend(&E.prompt, "This file is read-only!", 24);
+                if (E.readOnly) print("This file is read-only!");
+                else if (multiActive()) multiEdit(c);
+                else insertChar(c);
                 break;
         }
     } else {
         if (c == CTRL_KEY('q')) exit(0);
-        else if (c == CTRL_KEY('s')) { saveCommand(NULL); print("Success: File saved."); }
+        else if (c == CTRL_KEY('s')) { if (saveCommand(NULL) == 0) print("Success: File saved."); }
         else if (c == '\x1b') { setInsert(saveX, saveY); }
         else if (c == ARROW_UP) {
-            E.cmd = E.cmdSave;
+            bufReset(&E.cmd);
+            bufAppend(&E.cmd, E.cmdSave.b, E.cmdSave.len);
             E.cx = E.cmd.len + 1;
         }
         else if (c == ARROW_DOWN) {
-            bufFree(&E.cmd);
+            bufReset(&E.cmd);
             E.cx = 1;
         }
         else if (c == BACKSPACE && E.cx > 1) {
-            E.cmd.len--;
+            E.cmd.b[--E.cmd.len] = '\0';
             E.cx--;
         }
         
         else if (c == '\r') {
+            bufReset(&E.cmdSave);
+            bufAppend(&E.cmdSave, E.cmd.b, E.cmd.len);
+
             char *command = strtok(E.cmd.b, " ");
-            char *arg1;
+            char *arg1, *arg2;
             arg1 = strtok(NULL, " ");
+            arg2 = strtok(NULL, " ");
 
-            switch (getCommand(command)) {
+            switch (command ? getCommand(command) : -1) {
                 case OPEN:
                     if (arg1) {
                         openCommand(arg1);
@@ -745,7 +3133,7 @@ void processKeypress() {
                     } else print("Invalid option: No file name specified. No changes made.");
                     break;
                 case SAVE:
-                    saveCommand(arg1);
+                    if (saveCommand(arg1) == -1) break;
                     if (arg1) print("Success: File renamed and saved."); else print("Success: File saved.");
                     break;
                 case EXIT:
@@ -785,13 +3173,35 @@ void processKeypress() {
                 case HELP:
                     helpCommand();
                     break;
+                case STATS:
+                    statsCommand(arg1);
+                    break;
+                case SORT:
+                    if (E.readOnly) print("Error: This file is read-only!");
+                    else sortCommand(arg1);
+                    break;
+                case UNIQ:
+                    if (E.readOnly) print("Error: This file is read-only!");
+                    else uniqCommand(arg1);
+                    break;
+                case CUT:
+                    if (E.readOnly) print("Error: This file is read-only!");
+                    else if (arg1) cutCommand(arg1, arg2);
+                    else print("Invalid option: No fields specified.");
+                    break;
+                case HEX:
+                    hexCommand(arg1);
+                    break;
+                case VIEW:
+                    if (arg1) viewCommand(arg1);
+                    else print("Invalid option: No file path specified.");
+                    break;
                 default:
                     print("Invalid command: Command not recognized.");
                     break;
             }
 
-            E.cmdSave = E.cmd;
-            bufFree(&E.cmd);
+            bufReset(&E.cmd);
             E.cx = 1;
         }
         else if (c != BACKSPACE) {
@@ -811,46 +3221,280 @@ void initEditor() {
     E.cx = 1; E.cy = 2;
     E.offsetY = 0;
     E.startX = 7;
+    E.edits = 0;
+    E.coldY = -1;
     E.numrows = 0;
+    E.rowcap = 0;
     E.row = NULL;
     E.rowHl = 0;
     E.filename = NULL;
+    E.map = NULL;
+    E.mapSize = 0;
+    E.cacheFile = NULL;
     E.insert = 1;
-    E.cmd.b = NULL; E.cmd.len = 0;
-    E.prompt.b = NULL; E.prompt.len = 0;
+    E.cmd.b = NULL; E.cmd.len = 0; E.cmd.cap = 0;
+    E.prompt.b = NULL; E.prompt.len = 0; E.prompt.cap = 0;
+    E.frame.b = NULL; E.frame.len = 0; E.frame.cap = 0;
 
     E.readOnly = 0;
+    E.remote = 0;
+    atexit(saveCachePosition);
 }
 
 void refreshEditor() {
-    struct buf ab = BUF_INIT;
+    struct buf *ab = &E.frame;
+    bufReset(ab);
+    M.frames++;
 
-    bufAppend(&ab, "\x1b[?25l", 6); // Hide cursor
-    bufAppend(&ab, "\x1b[H", 3); // Move cursor to 1,1
+    bufAppend(ab, "\x1b[?25l", 6); // Hide cursor
+    bufAppend(ab, "\x1b[H", 3); // Move cursor to 1,1
 
-    drawRows(&ab);
+    drawRows(ab);
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy, E.cx + (E.insert ? E.startX - 1 : 0));
-    bufAppend(&ab, buf, strlen(buf));
-    bufAppend(&ab, "\x1b[?25h", 6); // Show cursor
+    if (E.insert && H.active)
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int) (H.cursor / HEX_WIDTH - H.top) + 2, hexCursorCol());
+    else
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy, E.cx + (E.insert ? E.startX - 1 : 0));
+    bufAppend(ab, buf, strlen(buf));
+    bufAppend(ab, "\x1b[?25h", 6); // Show cursor
+
+    write(STDOUT_FILENO, ab->b, ab->len);
+}
+
+void editorLoop() {
+    while (1) {
+        refreshEditor();
+        processKeypress();
+        compressColdRows();
+    }
+}
+
+//*** client/server ***//
+
+void socketPath(struct sockaddr_un *addr) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (dir && *dir) snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/jakk.sock", dir);
+    else snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/jakk-%d.sock", (int) getuid());
+}
+
+struct sharedBuf shared[SERVER_MAX_BUFS];
+int numShared;
+
+// Point the editor at a shared buffer
+void useShared(struct sharedBuf *b) {
+    E.row = b->row;
+    E.numrows = b->numrows;
+    E.rowcap = b->rowcap;
+    E.map = b->map;
+    E.mapSize = b->mapSize;
+    E.cacheFile = b->cacheFile;
+    E.cx = b->cx; E.cy = b->cy;
+    E.offsetY = b->offsetY;
+    E.readOnly = b->readOnly;
+}
+
+void dropShared(int i) {
+    useShared(&shared[i]);
+    closeFile();
+    free(shared[i].path);
+    memmove(&shared[i], &shared[i + 1], sizeof(struct sharedBuf) * (numShared - i - 1));
+    numShared--;
+}
+
+// Find the requested file among the loaded buffers, loading it if needed
+struct sharedBuf *loadShared(struct attachRequest *req) {
+    char path[PATH_MAX * 2 + 1], real[PATH_MAX];
+    struct stat st;
+
+    if (req->file[0] == '/') snprintf(path, sizeof(path), "%s", req->file);
+    else snprintf(path, sizeof(path), "%s/%s", req->cwd, req->file);
+    if (realpath(path, real) == NULL || stat(real, &st) == -1 || isBinaryFile(real)) return NULL;
+
+    for (int i = 0; i < numShared; i++) {
+        if (strcmp(shared[i].path, real)) continue;
+        if (shared[i].st.st_size == st.st_size && shared[i].st.st_mtim.tv_sec == st.st_mtim.tv_sec
+            && shared[i].st.st_mtim.tv_nsec == st.st_mtim.tv_nsec && shared[i].st.st_ino == st.st_ino)
+            return &shared[i];
+        dropShared(i); // Changed on disk since it was loaded
+        break;
+    }
+    if (numShared == SERVER_MAX_BUFS) dropShared(0);
+
+    E.row = NULL; E.numrows = 0; E.rowcap = 0;
+    E.map = NULL; E.mapSize = 0;
+    E.cacheFile = NULL;
+    openFile(real);
+    setFilename(NULL);
+
+    struct sharedBuf *b = &shared[numShared++];
+    b->path = strdup(real);
+    b->st = st;
+    b->row = E.row;
+    b->numrows = E.numrows;
+    b->rowcap = E.rowcap;
+    b->map = E.map;
+    b->mapSize = E.mapSize;
+    b->cacheFile = E.cacheFile;
+    b->cx = E.cx; b->cy = E.cy;
+    b->offsetY = E.offsetY;
+    b->readOnly = E.readOnly;
+    return b;
+}
+
+// Runs in the forked child, with the client connection as the terminal
+void serveSession(int fd, struct attachRequest *req, struct sharedBuf *b) {
+    // Time out reads so a lone ESC is not mistaken for the start of a sequence
+    struct timeval tv = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    chdir(req->cwd);
+    signal(SIGPIPE, SIG_DFL);
+
+    enableRawMode();
+    initEditor();
+    E.remote = 1;
+    E.screenrows = req->rows;
+    E.screencols = req->cols;
+
+    if (req->file[0] && isBinaryFile(req->file)) {
+        openPath(req->file);
+    } else if (b) {
+        useShared(b);
+        setFilename(req->file);
+    } else {
+        createFile();
+        if (req->file[0]) setFilename(req->file);
+    }
+
+    editorLoop();
+}
+
+// The other end of the socket runs as our user, anyone else could read keystrokes or edit our files
+int peerIsUs(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+int runServer() {
+    struct sockaddr_un addr;
+    socketPath(&addr);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    bufFree(&ab);
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd == -1) {
+        perror("socket");
+        return 1;
+    }
+    unlink(addr.sun_path);
+    mode_t mask = umask(077); // Nobody else may connect, not even before the chmod
+    int bound = bind(lfd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (bound == -1 || listen(lfd, 8) == -1) {
+        perror(addr.sun_path);
+        return 1;
+    }
+    chmod(addr.sun_path, 0600);
+
+    signal(SIGCHLD, SIG_IGN); // Sessions are reaped automatically
+    signal(SIGPIPE, SIG_IGN);
+    E.screenrows = 24;
+    E.screencols = 80;
+    printf("jakk: serving on %s\n", addr.sun_path);
+    fflush(stdout);
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd == -1) continue;
+        if (!peerIsUs(fd)) {
+            close(fd);
+            continue;
+        }
+
+        // The handshake runs in the accept loop, a silent client must not hold up the others
+        struct timeval tv = {SERVER_HANDSHAKE_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        struct attachRequest req;
+        if (readFull(fd, &req, sizeof(req)) == -1) {
+            close(fd);
+            continue;
+        }
+        req.cwd[PATH_MAX - 1] = '\0';
+        req.file[PATH_MAX - 1] = '\0';
+
+        struct sharedBuf *b = req.file[0] ? loadShared(&req) : NULL;
+
+        if (fork() == 0) {
+            close(lfd);
+            serveSession(fd, &req, b);
+        }
+        close(fd);
+    }
+}
+
+// Attach to the server and pass terminal I/O through until the session ends
+int runClient(const char *file) {
+    struct sockaddr_un addr;
+    struct attachRequest req;
+    socketPath(&addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(addr.sun_path);
+        return 1;
+    }
+    if (!peerIsUs(fd)) {
+        fprintf(stderr, "%s: server belongs to another user\n", addr.sun_path);
+        return 1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    if (getWindowSize(&req.rows, &req.cols) == -1) {
+        req.rows = 24;
+        req.cols = 80;
+    }
+    if (getcwd(req.cwd, sizeof(req.cwd)) == NULL) req.cwd[0] = '\0';
+    if (file) snprintf(req.file, sizeof(req.file), "%s", file);
+    if (writeFull(fd, &req, sizeof(req)) == -1) return 1;
+
+    enableRawMode();
+
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    char buf[65536];
+    while (poll(fds, 2, -1) != -1) {
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) fds[0].fd = -1; // Input is gone, keep showing output until the session ends
+            else if (writeFull(fd, buf, n) == -1) break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;
+            writeFull(STDOUT_FILENO, buf, n);
+        }
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
+    if (argc >= 2 && (!strcmp(argv[1], "--server") || !strcmp(argv[1], "-s")))
+        return runServer();
+    if (argc >= 2 && (!strcmp(argv[1], "--attach") || !strcmp(argv[1], "-a")))
+        return runClient(argc >= 3 ? argv[2] : NULL);
+
     enableRawMode();
 
     initEditor();
     
     if (argc >= 2) {
-        openFile(argv[1]);
+        openPath(argv[1]);
     }
     else createFile();
 
-    while (1) {
-        refreshEditor();
-        processKeypress();
-    }
+    editorLoop();
 }